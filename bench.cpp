@@ -0,0 +1,675 @@
+// Benchmarks for the 2srt2ass++ pipeline, and regression checks run before
+// them (alone with --check).
+//
+// Generates a deterministic pair of synthetic SRT files in memory and times
+// the individual stages (parse_time, parse_srt_buffer, convert_encoding,
+// text_to_ass_text, alignment_distance, write_ass_file) as well as the full
+// pipeline as main() runs it. Every stage reports ns/cue, MB/s and
+// allocations/cue.
+
+#define SRT2ASS_NO_MAIN
+#include "main.cpp"
+
+#include <chrono>
+#include <cstdint>
+#include <sstream>
+
+// Synthetic corpus generator {{{
+struct Rng {
+  uint64_t state;
+
+  uint64_t next()
+  {
+    // splitmix64
+    uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+  }
+
+  double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+  int range(int lo, int hi) { return lo + (int)(next() % (hi - lo + 1)); }
+};
+
+struct Corpus_Options {
+  size_t cues = 10000;
+  int line_length = 40;            // average characters per text line.
+  double tag_ratio = 0.1;          // fraction of cues wrapped in <i> or <b>.
+  bool crlf = false;
+  double offset = 2.5;             // seconds the top track is shifted by.
+  double drift = 0.0;              // relative clock drift of the top track.
+  std::string encoding = "UTF-8";  // UTF-8 or ISO-8859-1.
+  uint64_t seed = 1;
+};
+
+struct Corpus {
+  std::string bottom;
+  std::string top;
+};
+
+static const char *const g_words[] = {
+  "the",   "quick", "brown", "fox",   "jumps",  "over",    "lazy",  "dog",
+  "where", "are",   "you",   "going", "I",      "think",   "we",    "should",
+  "leave", "it",    "gets",  "dark",  "before", "tonight", "never", "mind",
+  "Anna",  "Paris", "Tom",   "Mrs",   "Harper", "Monday",  "Rome",  "Jack",
+};
+
+static void append_srt_time(std::string &out, Time t)
+{
+  if (t < 0) {
+    t = 0;
+  }
+  int ms = (int)std::lround(t * 1000.0);
+  char buf[32];
+  std::snprintf(
+    buf,
+    sizeof(buf),
+    "%02d:%02d:%02d,%03d",
+    ms / 3600000,
+    (ms / 60000) % 60,
+    (ms / 1000) % 60,
+    ms % 1000
+  );
+  out += buf;
+}
+
+static void append_text_line(
+  std::string &out,
+  Rng &rng,
+  const Corpus_Options &opt
+)
+{
+  int target =
+    std::max(4, rng.range(opt.line_length / 2, opt.line_length * 3 / 2));
+  size_t begin = out.size();
+  while ((int)(out.size() - begin) < target) {
+    if (out.size() != begin) {
+      out += ' ';
+    }
+    out += g_words[rng.next() % (sizeof(g_words) / sizeof(g_words[0]))];
+    if (rng.range(0, 15) == 0) {
+      // Sprinkle in some non-ASCII to give the encoding conversion work.
+      out += opt.encoding == "UTF-8" ? "\xc3\xa9" : "\xe9";
+    }
+    if (rng.range(0, 40) == 0) {
+      out += ' ';
+      out += std::to_string(rng.range(2, 2000));
+    }
+  }
+  if (rng.range(0, 7) == 0) {
+    out += rng.range(0, 1) ? '?' : '!';
+  }
+}
+
+// Appends the text of a cue, with its trailing blank line.
+static void append_cue_text(
+  std::string &out,
+  Rng &rng,
+  const Corpus_Options &opt
+)
+{
+  const char *nl = opt.crlf ? "\r\n" : "\n";
+  const char *tag = nullptr;
+  if (rng.uniform() < opt.tag_ratio) {
+    tag = rng.range(0, 1) ? "i" : "b";
+    out += '<';
+    out += tag;
+    out += '>';
+  }
+  int lines = rng.range(1, 2);
+  for (int l = 0; l < lines; ++l) {
+    if (l > 0) {
+      out += nl;
+    }
+    append_text_line(out, rng, opt);
+  }
+  if (tag) {
+    out += "</";
+    out += tag;
+    out += '>';
+  }
+  out += nl;
+  out += nl;
+}
+
+static void append_cue(
+  std::string &out,
+  size_t num,
+  Time start,
+  Time stop,
+  std::string_view text,
+  const Corpus_Options &opt
+)
+{
+  const char *nl = opt.crlf ? "\r\n" : "\n";
+  out += std::to_string(num);
+  out += nl;
+  append_srt_time(out, start);
+  out += " --> ";
+  append_srt_time(out, stop);
+  out += nl;
+  out += text;
+}
+
+Corpus generate_corpus(const Corpus_Options &opt)
+{
+  Corpus c;
+  Rng rng{opt.seed};
+  size_t bytes_per_cue = opt.line_length * 2 + 40;
+  c.bottom.reserve(opt.cues * bytes_per_cue);
+  c.top.reserve(opt.cues * bytes_per_cue);
+
+  Time t = 1.0;
+  std::string text;
+  for (size_t i = 0; i < opt.cues; ++i) {
+    t += 0.2 + rng.uniform() * 3.0;
+    Time duration = 1.0 + rng.uniform() * 4.0;
+    text.clear();
+    append_cue_text(text, rng, opt);
+    append_cue(c.bottom, i + 1, t, t + duration, text, opt);
+
+    // The top track follows the same timeline, subject to the offset, the
+    // drift, and a bit of per-cue jitter. Its text is that of the bottom
+    // track, with every third cue rewritten, so that anchor sync finds names,
+    // numbers and punctuation in common on most cues, but not all of them.
+    Time jitter = (rng.uniform() - 0.5) * 0.2;
+    Time top_start = t * (1.0 + opt.drift) + opt.offset + jitter;
+    Time top_stop = (t + duration) * (1.0 + opt.drift) + opt.offset + jitter;
+    if (i % 3 == 2) {
+      text.clear();
+      append_cue_text(text, rng, opt);
+    }
+    append_cue(c.top, i + 1, top_start, top_stop, text, opt);
+    t += duration;
+  }
+  return c;
+}
+// }}}
+
+// Regression checks {{{
+// Auto-sync must not be confident about a shift when the actual offset is
+// beyond the searched +-10 s: the basin of the cost curve then spans the
+// whole window, and nothing outside of it to compare with used to read as a
+// confidence of 1. Checked on both sides of the window, against an offset
+// within it.
+bool check_sync_confidence()
+{
+  bool ok = true;
+  for (double offset : {2.5, 95.0, -40.0, 12.0}) {
+    Corpus_Options opt;
+    opt.cues = 1500;
+    opt.offset = offset;
+    Corpus corpus = generate_corpus(opt);
+    SRT_File bottom = parse_srt_buffer(corpus.bottom);
+    SRT_File top = parse_srt_buffer(corpus.top);
+    size_t evaluations = 0;
+    Sync_Report report;
+    double shift = find_best_shift(bottom, top, evaluations, {}, &report);
+    const bool in_range = std::abs(offset) < 10.0;
+    if (in_range ? report.confidence < 0.5 || std::abs(shift + offset) > 0.1
+                 : report.confidence > 0.0) {
+      std::printf(
+        "check failed: offset %.1f s synced to %.2f s with confidence %.2f\n",
+        offset,
+        shift,
+        report.confidence
+      );
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+// --batch runs all jobs in one process, so stream jobs that didn't close
+// their inputs made every job fail once the descriptors ran out. Runs more
+// stream jobs than the descriptor limit, with bad encodings and non-SRT
+// inputs among them for the error paths, and expects only those to fail.
+bool check_stream_batch()
+{
+  const std::filesystem::path dir =
+    std::filesystem::temp_directory_path() / "2srt2ass_check";
+  std::filesystem::create_directories(dir);
+  Corpus_Options opt;
+  opt.cues = 20;
+  Corpus corpus = generate_corpus(opt);
+  std::ofstream(dir / "bottom.srt", std::ios::binary) << corpus.bottom;
+  std::ofstream(dir / "top.srt", std::ios::binary) << corpus.top;
+  std::ofstream(dir / "top.ass", std::ios::binary)
+    << "[Script Info]\n\n[Events]\n";
+  const int jobs = 300;
+  int expected_failures = 0;
+  {
+    std::ofstream batch(dir / "jobs.txt");
+    for (int i = 0; i < jobs; ++i) {
+      batch << "--stream -b \"" << (dir / "bottom.srt").string() << "\" -t \""
+            << (dir / (i % 3 == 2 ? "top.ass" : "top.srt")).string()
+            << "\" -o \"" << (dir / "out.ass").string() << "\""
+            << (i % 5 == 4 ? " --b-enc NO-SUCH-ENCODING" : "") << "\n";
+      expected_failures += i % 3 == 2 || i % 5 == 4;
+    }
+  }
+
+  // Errors of the failing jobs are expected; keep them off the terminal.
+  rlimit limit;
+  getrlimit(RLIMIT_NOFILE, &limit);
+  rlimit low = limit;
+  low.rlim_cur = std::min<rlim_t>(limit.rlim_cur, 64);
+  setrlimit(RLIMIT_NOFILE, &low);
+  const Log_Level log_level = g_log_level;
+  g_log_level = Log_Level::error;
+  std::fflush(stderr);
+  int saved_stderr = dup(2);
+  int null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, 2);
+  close(null_fd);
+  size_t failed = run_batch((dir / "jobs.txt").string(), "2srt2ass++");
+  std::fflush(stderr);
+  dup2(saved_stderr, 2);
+  close(saved_stderr);
+  g_log_level = log_level;
+  setrlimit(RLIMIT_NOFILE, &limit);
+  std::filesystem::remove_all(dir);
+
+  if (failed != (size_t)expected_failures) {
+    std::printf(
+      "check failed: %zu of %d stream jobs failed under a limit of %d open "
+      "files, instead of %d\n",
+      failed,
+      jobs,
+      (int)low.rlim_cur,
+      expected_failures
+    );
+    return false;
+  }
+  return true;
+}
+// }}}
+
+// Benchmark harness {{{
+struct Null_Buffer : std::streambuf {
+  size_t bytes = 0;
+
+  int overflow(int c) override
+  {
+    ++bytes;
+    return c;
+  }
+
+  std::streamsize xsputn(const char *, std::streamsize n) override
+  {
+    bytes += n;
+    return n;
+  }
+};
+
+static volatile double g_sink;
+
+template <typename Setup, typename Body>
+void run_bench(
+  const char *name,
+  size_t cues,
+  size_t bytes,
+  int repeat,
+  Setup &&setup,
+  Body &&body
+)
+{
+  using Clock = std::chrono::steady_clock;
+  double best_ns = std::numeric_limits<double>::max();
+  size_t allocs = 0;
+  for (int r = 0; r < repeat; ++r) {
+    auto state = setup();
+    size_t allocs_before = g_alloc_count.load();
+    auto t0 = Clock::now();
+    body(state);
+    auto t1 = Clock::now();
+    allocs = g_alloc_count.load() - allocs_before;
+    double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+    best_ns = std::min(best_ns, ns);
+  }
+  std::printf(
+    "%-22s %12.1f ns/cue %10.1f MB/s %10.2f allocs/cue\n",
+    name,
+    best_ns / cues,
+    bytes / (best_ns * 1e-9) / (1024.0 * 1024.0),
+    (double)allocs / cues
+  );
+}
+// }}}
+
+int main(int argc, char **argv)
+{
+  argparse::ArgumentParser program(argv[0]);
+  program.add_argument("--cues")
+    .help("Number of cues per generated SRT file.")
+    .default_value(10000)
+    .scan<'i', int>();
+  program.add_argument("--line-length")
+    .help("Average number of characters per subtitle line.")
+    .default_value(40)
+    .scan<'i', int>();
+  program.add_argument("--tags")
+    .help("Fraction of cues wrapped in <i> or <b> tags.")
+    .default_value(0.1)
+    .scan<'f', double>();
+  program.add_argument("--crlf")
+    .help("Use CRLF line endings instead of LF.")
+    .flag();
+  program.add_argument("--offset")
+    .help("Offset in seconds of the top track relative to the bottom track.")
+    .default_value(2.5)
+    .scan<'f', double>();
+  program.add_argument("--drift")
+    .help("Relative clock drift of the top track (e.g. 0.001).")
+    .default_value(0.0)
+    .scan<'f', double>();
+  program.add_argument("--encoding")
+    .help("Encoding of the generated files: UTF-8 or ISO-8859-1.")
+    .default_value("UTF-8");
+  program.add_argument("--seed")
+    .help("Seed of the corpus generator.")
+    .default_value(1)
+    .scan<'i', int>();
+  program.add_argument("--repeat")
+    .help("Number of repetitions per benchmark; the fastest one is reported.")
+    .default_value(5)
+    .scan<'i', int>();
+  program.add_argument("--no-e2e-sync")
+    .help("Leave auto-sync out of the end-to-end benchmark.")
+    .flag();
+  program.add_argument("--check")
+    .help("Only run the regression checks.")
+    .flag();
+  program.add_argument("--write-pair")
+    .help(
+      "Write the generated pair to PREFIX.bottom.srt and PREFIX.top.srt and "
+      "exit."
+    );
+
+  try {
+    program.parse_args(argc, argv);
+  } catch (std::exception &err) {
+    std::cout << "Error: " << err.what() << "\n";
+    std::cout << program;
+    return 1;
+  }
+
+  Corpus_Options opt;
+  opt.cues = program.get<int>("--cues");
+  opt.line_length = program.get<int>("--line-length");
+  opt.tag_ratio = program.get<double>("--tags");
+  opt.crlf = program.get<bool>("--crlf");
+  opt.offset = program.get<double>("--offset");
+  opt.drift = program.get<double>("--drift");
+  opt.encoding = program.get("--encoding");
+  opt.seed = program.get<int>("--seed");
+  const int repeat = std::max(1, program.get<int>("--repeat"));
+  const bool e2e_sync = !program.get<bool>("--no-e2e-sync");
+  if (opt.encoding != "UTF-8" && opt.encoding != "ISO-8859-1") {
+    std::cout << "Unsupported encoding: " << opt.encoding << "\n";
+    return 1;
+  }
+
+  if (!check_sync_confidence() || !check_stream_batch()) {
+    return 1;
+  }
+  if (program.get<bool>("--check")) {
+    std::printf("All checks passed.\n");
+    return 0;
+  }
+
+  g_count_allocations = true;
+  Corpus corpus = generate_corpus(opt);
+
+  if (program.is_used("--write-pair")) {
+    std::string prefix = program.get("--write-pair");
+    std::ofstream(prefix + ".bottom.srt", std::ios::binary) << corpus.bottom;
+    std::ofstream(prefix + ".top.srt", std::ios::binary) << corpus.top;
+    return 0;
+  }
+
+  const size_t n = opt.cues;
+  const size_t bytes = corpus.bottom.size();
+  std::printf(
+    "Corpus: %zu cues/track, %.2f MB bottom, %.2f MB top, %s, %s\n",
+    n,
+    corpus.bottom.size() / (1024.0 * 1024.0),
+    corpus.top.size() / (1024.0 * 1024.0),
+    opt.encoding.c_str(),
+    opt.crlf ? "CRLF" : "LF"
+  );
+
+  // Reference data shared by the microbenchmarks.
+  SRT_File bottom_ref, top_ref;
+  bottom_ref = parse_srt_buffer(corpus.bottom);
+  top_ref = parse_srt_buffer(corpus.top);
+  std::vector<std::string> times;
+  size_t time_bytes = 0;
+  times.reserve(n);
+  for (const SRT_Subtitle &sub : bottom_ref.subtitles) {
+    times.emplace_back();
+    append_srt_time(times.back(), sub.start);
+    time_bytes += times.back().size();
+  }
+  size_t text_bytes = 0;
+  for (const SRT_Subtitle &sub : bottom_ref.subtitles) {
+    text_bytes += sub.text.size();
+  }
+
+  run_bench(
+    "parse_time",
+    n,
+    time_bytes,
+    repeat,
+    [] { return 0; },
+    [&](int) {
+      double acc = 0;
+      for (const std::string &t : times) {
+        acc += parse_time(t);
+      }
+      g_sink = acc;
+    }
+  );
+
+  run_bench(
+    "parse_srt_buffer",
+    n,
+    bytes,
+    repeat,
+    [] { return 0; },
+    [&](int) {
+      SRT_File srt = parse_srt_buffer(corpus.bottom);
+      g_sink = srt.subtitles.size();
+    }
+  );
+
+  if (opt.encoding != "UTF-8") {
+    run_bench(
+      "convert_encoding",
+      n,
+      text_bytes,
+      repeat,
+      [&] { return bottom_ref; },
+      [&](SRT_File &srt) {
+        convert_encoding(srt, opt.encoding.c_str(), "UTF-8");
+        g_sink = srt.subtitles.size();
+      }
+    );
+  }
+
+  run_bench(
+    "text_to_ass_text",
+    n,
+    text_bytes,
+    repeat,
+    [] { return 0; },
+    [&](int) {
+      size_t acc = 0;
+      for (const SRT_Subtitle &sub : bottom_ref.subtitles) {
+        acc += text_to_ass_text(sub.text).size();
+      }
+      g_sink = acc;
+    }
+  );
+
+  const Start_Index bottom_index = build_start_index(bottom_ref);
+  const Start_Index top_index = build_start_index(top_ref);
+  run_bench(
+    "alignment_distance",
+    n,
+    n * 2 * sizeof(Time),
+    repeat,
+    [] { return 0; },
+    [&](int) {
+      g_sink = alignment_distance(bottom_index, top_index, opt.offset);
+    }
+  );
+
+  // find_best_shift, with pruning, for every cost.
+  for (int cost = 0; cost < 4; ++cost) {
+    std::string name =
+      std::string("sync cost (") + g_sync_cost_names[cost] + ")";
+    run_bench(
+      name.c_str(),
+      n,
+      n * 2 * sizeof(Time),
+      repeat,
+      [] { return 0; },
+      [&](int) {
+        size_t evaluations = 0;
+        g_sink =
+          find_best_shift(bottom_ref, top_ref, evaluations, {Sync_Cost(cost)});
+      }
+    );
+  }
+
+  // Make sure the anchor path is the one measured, not the bail-out.
+  {
+    Anchor_Sync_Result result;
+    bool found = anchor_sync(bottom_ref, top_ref, result);
+    Time shift = result.map(0.0);
+    if (!found || std::abs(shift + opt.offset) > 0.5) {
+      std::printf(
+        "anchor_sync: expected a shift of %.2f s, found %.2f s (%s)\n",
+        -opt.offset,
+        shift,
+        found ? "synced" : "no sync"
+      );
+    }
+  }
+  run_bench(
+    "anchor_sync",
+    2 * n,
+    text_bytes * 2,
+    repeat,
+    [] { return Anchor_Sync_Result(); },
+    [&](Anchor_Sync_Result &result) {
+      g_sink = anchor_sync(bottom_ref, top_ref, result) + result.anchors;
+    }
+  );
+
+  const std::vector<ASS_Style> styles(
+    std::begin(g_builtin_styles), std::begin(g_builtin_styles) + 2
+  );
+  ASS_File merged;
+  merged.styles = styles;
+  merge_tracks(merged, {&bottom_ref, &top_ref});
+  run_bench(
+    "pair_tracks",
+    2 * n,
+    text_bytes * 2,
+    repeat,
+    [] { return 0; },
+    [&](int) {
+      ASS_File paired;
+      pair_tracks(paired, bottom_ref, top_ref);
+      g_sink = paired.subtitles.size();
+    }
+  );
+  run_bench(
+    "write_ass_file",
+    merged.subtitles.size(),
+    text_bytes * 2,
+    repeat,
+    [] { return Null_Buffer(); },
+    [&](Null_Buffer &buf) {
+      std::ostream out(&buf);
+      write_ass_file(out, merged);
+      g_sink = buf.bytes;
+    }
+  );
+  for (const Output_Format &format : g_output_formats) {
+    if (&format == &g_output_formats[0]) {
+      continue;  // write_ass_file above.
+    }
+    std::string name = std::string("write_subtitles (") + format.name + ")";
+    run_bench(
+      name.c_str(),
+      merged.subtitles.size(),
+      text_bytes * 2,
+      repeat,
+      [] { return Null_Buffer(); },
+      [&](Null_Buffer &buf) {
+        std::ostream out(&buf);
+        write_subtitles(out, format, merged);
+        g_sink = buf.bytes;
+      }
+    );
+  }
+
+  // The other readers, on the bottom track written out in their format.
+  ASS_File bottom_only;
+  bottom_only.styles = styles;
+  merge_tracks(bottom_only, {&bottom_ref});
+  for (const char *name : {"vtt", "ass"}) {
+    std::string prefix = std::string(name) + ":";
+    std::ostringstream rendered;
+    write_subtitles(rendered, output_format(prefix), bottom_only);
+    std::string content = rendered.str();
+    std::string bench_name = std::string("parse_subtitles (") + name + ")";
+    run_bench(
+      bench_name.c_str(),
+      n,
+      content.size(),
+      repeat,
+      [] { return 0; },
+      [&](int) {
+        SRT_File srt =
+          parse_subtitles(content, *find_input_format(name), 0.0);
+        g_sink = srt.subtitles.size();
+      }
+    );
+  }
+
+  // The whole pipeline, as main() runs it for two in-memory files.
+  run_bench(
+    e2e_sync ? "end-to-end (auto-sync)" : "end-to-end",
+    2 * n,
+    corpus.bottom.size() + corpus.top.size(),
+    repeat,
+    [] { return 0; },
+    [&](int) {
+      SRT_File bottom_srt = parse_srt_buffer(corpus.bottom);
+      SRT_File top_srt = parse_srt_buffer(corpus.top);
+      if (opt.encoding != "UTF-8") {
+        convert_encoding(bottom_srt, opt.encoding.c_str(), "UTF-8");
+        convert_encoding(top_srt, opt.encoding.c_str(), "UTF-8");
+      }
+      if (e2e_sync) {
+        size_t evaluations = 0;
+        time_transform(
+          top_srt,
+          Time_Map{1.0, find_best_shift(bottom_srt, top_srt, evaluations)}
+        );
+      }
+      ASS_File ass;
+      ass.styles = styles;
+      merge_tracks(ass, {&bottom_srt, &top_srt});
+      Null_Buffer buf;
+      std::ostream out(&buf);
+      write_ass_file(out, ass);
+      g_sink = buf.bytes;
+    }
+  );
+  return 0;
+}
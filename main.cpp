@@ -1,22 +1,453 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdarg>
 #include <charconv>
+#include <chrono>
+#include <csignal>
 #include <cstdio>
 #include <cstring>
+#include <filesystem>
 #include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
 #include <vector>
 #include <cmath>
+#include <complex>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
 
 #include "argparse.hpp"
+#include <fcntl.h>
 #include <iconv.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using Time = double;
 
+// Counts the heap allocations made by the process for --profile and
+// --metrics-json. The counter is only touched once one of them has set
+// g_count_allocations, before any worker thread starts; otherwise an
+// allocation costs a branch on top of malloc().
+bool g_count_allocations = false;
+std::atomic<size_t> g_alloc_count{0};
+
+#if defined(__GNUC__) && !defined(__clang__)
+// GCC can't see that the replaced operator new below pairs with free().
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void *operator new(std::size_t size)
+{
+  if (g_count_allocations) {
+    g_alloc_count.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (void *p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+  std::free(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept
+{
+  std::free(p);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+// Logging {{{
+// Messages go to stderr, or to the calling thread's log buffer while it has
+// one, for work done in parallel whose messages are printed in order
+// afterwards. Errors always go straight to stderr, so that they are seen even
+// if the work is given up on. The level is checked before anything gets
+// formatted.
+enum class Log_Level {
+  error,    // and warnings; all that --quiet leaves.
+  info,     // progress; the default.
+  verbose,  // -v
+  debug,    // -vv: every step of the searches.
+};
+
+Log_Level g_log_level = Log_Level::info;
+thread_local std::string *t_log_buffer = nullptr;
+
+bool log_enabled(Log_Level level)
+{
+  return level <= g_log_level;
+}
+
+// Writes an already formatted message.
+void log_write(std::string_view message, Log_Level level = Log_Level::info)
+{
+  if (t_log_buffer && level != Log_Level::error) {
+    t_log_buffer->append(message);
+  } else {
+    std::fwrite(message.data(), 1, message.size(), stderr);
+  }
+}
+
+__attribute__((format(printf, 2, 3)))
+void log_printf(Log_Level level, const char *format, ...)
+{
+  if (!log_enabled(level)) {
+    return;
+  }
+  char buf[256];
+  va_list args;
+  va_start(args, format);
+  int len = std::vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  if (len < 0) {
+    return;
+  }
+  if ((size_t)len < sizeof(buf)) {
+    log_write(std::string_view(buf, len), level);
+    return;
+  }
+  std::string message(len, '\0');
+  va_start(args, format);
+  std::vsnprintf(message.data(), len + 1, format, args);
+  va_end(args);
+  log_write(message, level);
+}
+
+// A message put together with <<, written at the end of the statement:
+//   Log(Log_Level::info) << "Reading " << filename << "...\n";
+// If the level is disabled, no stream is even created.
+struct Log {
+  Log_Level level;
+  std::unique_ptr<std::ostringstream> stream;  // null if disabled.
+
+  explicit Log(Log_Level level) : level(level)
+  {
+    if (log_enabled(level)) {
+      stream = std::make_unique<std::ostringstream>();
+    }
+  }
+  ~Log()
+  {
+    if (stream) {
+      log_write(stream->str(), level);
+    }
+  }
+
+  template <typename T> Log &operator<<(const T &value)
+  {
+    if (stream) {
+      *stream << value;
+    }
+    return *this;
+  }
+  Log &operator<<(std::ios_base &(*manipulator)(std::ios_base &))
+  {
+    if (stream) {
+      *stream << manipulator;
+    }
+    return *this;
+  }
+};
+// }}}
+
+// Stages may be timed on several threads at once, so the counters are
+// atomic and `stages` is guarded by `mutex`.
+struct Metrics {
+  struct Stage {
+    const char *name;
+    double begin;  // seconds since startup.
+    double seconds;
+  };
+  std::mutex mutex;
+  std::vector<Stage> stages;
+  std::atomic<size_t> bytes_read{0};
+  std::atomic<size_t> cues_parsed{0};
+  std::atomic<size_t> shifts_evaluated{0};
+  std::atomic<size_t> shifts_pruned{0};  // given up on part way through.
+
+  // Only while no stages are being timed.
+  void clear()
+  {
+    stages.clear();
+    bytes_read = 0;
+    cues_parsed = 0;
+    shifts_evaluated = 0;
+    shifts_pruned = 0;
+  }
+
+  void add(const Metrics &other)
+  {
+    stages.insert(stages.end(), other.stages.begin(), other.stages.end());
+    bytes_read += other.bytes_read;
+    cues_parsed += other.cues_parsed;
+    shifts_evaluated += other.shifts_evaluated;
+    shifts_pruned += other.shifts_pruned;
+  }
+};
+
+Metrics g_metrics;
+
+// Trace events {{{
+// Complete ("ph":"X") events in the Chrome trace-event format. Every thread
+// records into its own fixed-size ring buffer, so recording needs no locks;
+// only the first event of a thread takes the registry mutex. Threads hand
+// their buffer back when they exit, for the next new thread to carry on with,
+// so there are only ever as many buffers as threads running at once. Events
+// carry the --batch job they were recorded for (0 outside of --batch) as
+// their pid. With tracing disabled, a trace scope costs a single branch.
+struct Trace_Event {
+  const char *name;
+  int64_t begin_ns;
+  int64_t duration_ns;
+  int job;
+};
+
+struct Trace_Buffer {
+  static constexpr size_t capacity = 1 << 16;
+  std::unique_ptr<Trace_Event[]> events{new Trace_Event[capacity]};
+  std::atomic<size_t> count{0};  // total recorded; wraps around the ring.
+  int tid;
+};
+
+bool g_trace_enabled = false;
+const std::chrono::steady_clock::time_point g_trace_epoch =
+  std::chrono::steady_clock::now();
+std::mutex g_trace_registry_mutex;
+std::vector<std::unique_ptr<Trace_Buffer>> g_trace_registry;
+std::vector<Trace_Buffer *> g_trace_free_buffers;  // of exited threads.
+
+// The buffer of the thread, returned to g_trace_free_buffers on exit.
+struct Trace_Thread {
+  Trace_Buffer *buffer = nullptr;
+
+  ~Trace_Thread()
+  {
+    if (buffer) {
+      std::lock_guard<std::mutex> lock(g_trace_registry_mutex);
+      g_trace_free_buffers.push_back(buffer);
+    }
+  }
+};
+
+thread_local Trace_Thread t_trace_thread;
+thread_local int t_trace_job = 0;
+
+int64_t trace_now_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now() - g_trace_epoch
+  )
+    .count();
+}
+
+void trace_record(const char *name, int64_t begin_ns, int64_t end_ns)
+{
+  Trace_Buffer *buf = t_trace_thread.buffer;
+  if (!buf) {
+    std::lock_guard<std::mutex> lock(g_trace_registry_mutex);
+    if (!g_trace_free_buffers.empty()) {
+      buf = g_trace_free_buffers.back();
+      g_trace_free_buffers.pop_back();
+    } else {
+      g_trace_registry.push_back(std::make_unique<Trace_Buffer>());
+      buf = g_trace_registry.back().get();
+      buf->tid = (int)g_trace_registry.size();
+    }
+    t_trace_thread.buffer = buf;
+  }
+  size_t n = buf->count.load(std::memory_order_relaxed);
+  buf->events[n % Trace_Buffer::capacity] = {
+    name, begin_ns, end_ns - begin_ns, t_trace_job
+  };
+  buf->count.store(n + 1, std::memory_order_release);
+}
+
+// Starts a thread that records its trace events for the job of the calling
+// thread.
+template <typename F> std::thread traced_thread(F &&f)
+{
+  return std::thread([job = t_trace_job, f = std::forward<F>(f)]() mutable {
+    t_trace_job = job;
+    f();
+  });
+}
+
+struct Trace_Scope {
+  const char *name;
+  int64_t begin_ns;
+
+  explicit Trace_Scope(const char *name) :
+    name(name), begin_ns(g_trace_enabled ? trace_now_ns() : 0)
+  {
+  }
+  ~Trace_Scope()
+  {
+    if (g_trace_enabled) {
+      trace_record(name, begin_ns, trace_now_ns());
+    }
+  }
+};
+
+// Call once all recording threads are done.
+void write_trace_json(std::ostream &out)
+{
+  std::lock_guard<std::mutex> lock(g_trace_registry_mutex);
+  out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+  bool first = true;
+  char buf[256];
+  for (const auto &thread : g_trace_registry) {
+    size_t count = thread->count.load(std::memory_order_acquire);
+    size_t begin = count > Trace_Buffer::capacity
+                     ? count - Trace_Buffer::capacity
+                     : 0;
+    for (size_t i = begin; i < count; ++i) {
+      const Trace_Event &e = thread->events[i % Trace_Buffer::capacity];
+      std::snprintf(
+        buf,
+        sizeof(buf),
+        "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, "
+        "\"dur\": %.3f, \"pid\": %d, \"tid\": %d}",
+        first ? "" : ",",
+        e.name,
+        e.begin_ns * 1e-3,
+        e.duration_ns * 1e-3,
+        e.job,
+        thread->tid
+      );
+      out << buf;
+      first = false;
+    }
+  }
+  out << "\n]}\n";
+}
+// }}}
+
+// Adds the lifetime of the timer as a stage to g_metrics, and records it as
+// a trace event.
+struct Scoped_Timer {
+  using Clock = std::chrono::steady_clock;
+  const char *name;
+  Clock::time_point start;
+  Trace_Scope trace;
+
+  explicit Scoped_Timer(const char *name) :
+    name(name), start(Clock::now()), trace(name)
+  {
+  }
+  ~Scoped_Timer()
+  {
+    std::chrono::duration<double> begin = start - g_trace_epoch;
+    std::chrono::duration<double> dt = Clock::now() - start;
+    std::lock_guard<std::mutex> lock(g_metrics.mutex);
+    g_metrics.stages.push_back({name, begin.count(), dt.count()});
+  }
+};
+
+// Wall-clock time covered by the stages. Stages that overlap, because they
+// ran concurrently or nested, are only counted once.
+double stages_wall_seconds(const Metrics &m)
+{
+  std::vector<std::pair<double, double>> spans;
+  for (const Metrics::Stage &stage : m.stages) {
+    spans.push_back({stage.begin, stage.begin + stage.seconds});
+  }
+  std::sort(spans.begin(), spans.end());
+  double total = 0.0;
+  double covered = -std::numeric_limits<double>::infinity();
+  for (const auto &[begin, end] : spans) {
+    total += std::max(0.0, end - std::max(begin, covered));
+    covered = std::max(covered, end);
+  }
+  return total;
+}
+
+long peak_rss_kb()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+void print_metrics(std::ostream &out, const Metrics &m)
+{
+  out << "Profile:\n";
+  for (const Metrics::Stage &stage : m.stages) {
+    char buf[128];
+    std::snprintf(
+      buf, sizeof(buf), "  %-22s %10.3f ms\n", stage.name, stage.seconds * 1e3
+    );
+    out << buf;
+  }
+  char buf[128];
+  std::snprintf(
+    buf,
+    sizeof(buf),
+    "  %-22s %10.3f ms\n",
+    "total",
+    stages_wall_seconds(m) * 1e3
+  );
+  out << buf;
+  out << "  bytes read       : " << m.bytes_read << "\n";
+  out << "  cues parsed      : " << m.cues_parsed << "\n";
+  out << "  shifts evaluated : " << m.shifts_evaluated << "\n";
+  out << "  shifts pruned    : " << m.shifts_pruned << "\n";
+  out << "  allocations      : " << g_alloc_count.load() << "\n";
+  out << "  peak RSS         : " << peak_rss_kb() << " KiB\n";
+}
+
+void write_metrics_json(std::ostream &out, const Metrics &m)
+{
+  out << "{\n  \"stages\": [";
+  for (size_t i = 0; i < m.stages.size(); ++i) {
+    out << (i ? ",\n" : "\n") << "    {\"name\": \"" << m.stages[i].name
+        << "\", \"ms\": " << m.stages[i].seconds * 1e3 << "}";
+  }
+  out << "\n  ],\n";
+  out << "  \"total_ms\": " << stages_wall_seconds(m) * 1e3 << ",\n";
+  out << "  \"bytes_read\": " << m.bytes_read << ",\n";
+  out << "  \"cues_parsed\": " << m.cues_parsed << ",\n";
+  out << "  \"shifts_evaluated\": " << m.shifts_evaluated << ",\n";
+  out << "  \"shifts_pruned\": " << m.shifts_pruned << ",\n";
+  out << "  \"allocations\": " << g_alloc_count.load() << ",\n";
+  out << "  \"peak_rss_kb\": " << peak_rss_kb() << "\n";
+  out << "}\n";
+}
+
+// Malformed input throws, so that only the job reading it fails, even when
+// it is read on a worker thread.
 void assert_good(std::from_chars_result t, const char *what)
 {
   if (t.ec != std::errc()) {
-    std::cout << "Invalid " << what << ".\n";
-    exit(1);
+    throw std::runtime_error(std::string("Invalid ") + what + ".");
   }
 }
 
@@ -38,20 +469,21 @@ Time parse_time(std::string_view view)
   double scale[] = {0.1f, 0.01f, 0.001f, 0.0001f};
   int fraction_size = view.size() - (s2 + 1);
   if (fraction_size > 3) {
-    std::cout << "Too many decimals in time: " << view
-              << ", fraction=" << view.substr(s2 + 1) << "\n";
-    std::cout << "view.size() = " << view.size() << "\n";
-    std::cout << "s2 + 1 = " << s2 + 1 << "\n";
+    Log(Log_Level::debug) << "view.size() = " << view.size() << "\n";
+    Log(Log_Level::debug) << "s2 + 1 = " << s2 + 1 << "\n";
     for (char c : view) {
-      std::cout << " char: " << (int)c << "\n";
+      Log(Log_Level::debug) << " char: " << (int)c << "\n";
     }
-    exit(1);
+    throw std::runtime_error(
+      "Too many decimals in time: " + std::string(view)
+      + ", fraction=" + std::string(view.substr(s2 + 1))
+    );
   }
   return (hour * 3600 + minute * 60 + second)
     + (fraction * scale[fraction_size - 1]);
 }
 
-std::string time_to_ass_str(Time t)
+void append_ass_time(std::string &out, Time t)
 {
   int seconds = (int)t;
   int minutes = seconds / 60;
@@ -59,12 +491,29 @@ std::string time_to_ass_str(Time t)
   int hours = minutes / 60;
   minutes %= 60;
   int centis = (int)((t - (int)t) * 100.0);
+  if (t >= 0 && hours < 10) {
+    // The common case, without going through snprintf.
+    char buf[10] = {
+      char('0' + hours),
+      ':',
+      char('0' + minutes / 10),
+      char('0' + minutes % 10),
+      ':',
+      char('0' + seconds / 10),
+      char('0' + seconds % 10),
+      '.',
+      char('0' + centis / 10),
+      char('0' + centis % 10),
+    };
+    out.append(buf, sizeof(buf));
+    return;
+  }
   char buf[32];  // give it enough space to shut up the compiler for impossible
                  // numbers.
-  std::snprintf(
+  int len = std::snprintf(
     buf, sizeof(buf), "%d:%02d:%02d.%02d", hours, minutes, seconds, centis
   );
-  return std::string(buf);
+  out.append(buf, len);
 }
 
 struct SRT_Subtitle {
@@ -77,13 +526,163 @@ struct SRT_File {
   std::vector<SRT_Subtitle> subtitles;
 };
 
+// Time transforms {{{
+// The time map t -> scale * t + shift.
+struct Time_Map {
+  double scale = 1.0;
+  double shift = 0.0;
+
+  Time operator()(Time t) const { return scale * t + shift; }
+
+  // This map applied to the result of `first`.
+  Time_Map after(const Time_Map &first) const
+  {
+    return {scale * first.scale, scale * first.shift + shift};
+  }
+};
+
+// A piecewise-linear time map: maps[i] applies from bounds[i - 1] up to
+// bounds[i], the first and last segments extending without end. Offsets and
+// frame rate scalings are the single-segment case. Transforms are composed
+// with after() rather than applied in turn, so that the cues of a track are
+// only mapped once. All scales are positive, which keeps the cue order.
+struct Time_Transform {
+  std::vector<Time> bounds;
+  std::vector<Time_Map> maps;
+
+  Time_Transform(const Time_Map &map = {}) : maps{map} {}
+
+  bool is_identity() const
+  {
+    return bounds.empty() && maps[0].scale == 1.0 && maps[0].shift == 0.0;
+  }
+
+  // The segment of `t`, trying segment `hint` first.
+  size_t segment(Time t, size_t hint = 0) const
+  {
+    if ((hint == 0 || bounds[hint - 1] <= t)
+        && (hint == bounds.size() || t < bounds[hint])) {
+      return hint;
+    }
+    return std::upper_bound(bounds.begin(), bounds.end(), t) - bounds.begin();
+  }
+
+  Time operator()(Time t) const { return maps[segment(t)](t); }
+
+  // This transform applied to the result of `first`: each segment of `first`
+  // is split where it maps onto a bound of this one.
+  Time_Transform after(const Time_Transform &first) const
+  {
+    const Time inf = std::numeric_limits<Time>::infinity();
+    Time_Transform result;
+    result.maps.clear();
+    for (size_t i = 0; i < first.maps.size(); ++i) {
+      const Time_Map &f = first.maps[i];
+      Time lo = i == 0 ? -inf : first.bounds[i - 1];
+      Time hi = i == first.bounds.size() ? inf : first.bounds[i];
+      if (i > 0) {
+        result.bounds.push_back(lo);
+      }
+      size_t j = segment(f(lo));
+      result.maps.push_back(maps[j].after(f));
+      for (; j < bounds.size() && bounds[j] < f(hi); ++j) {
+        result.bounds.push_back(std::max(lo, (bounds[j] - f.shift) / f.scale));
+        result.maps.push_back(maps[j + 1].after(f));
+      }
+    }
+    return result;
+  }
+};
+
+// Maps the times of the cues in [begin, end), in a single pass. The segment
+// of the previous cue is tried first, as cues mostly come in order.
+void time_transform(
+  std::vector<SRT_Subtitle>::iterator begin,
+  std::vector<SRT_Subtitle>::iterator end,
+  const Time_Transform &transform
+)
+{
+  if (transform.bounds.empty()) {
+    const Time_Map map = transform.maps[0];
+    for (auto sub = begin; sub != end; ++sub) {
+      sub->start = map(sub->start);
+      sub->stop = map(sub->stop);
+    }
+    return;
+  }
+  size_t segment = 0;
+  for (auto sub = begin; sub != end; ++sub) {
+    segment = transform.segment(sub->start, segment);
+    size_t stop_segment = transform.segment(sub->stop, segment);
+    sub->start = transform.maps[segment](sub->start);
+    sub->stop = transform.maps[stop_segment](sub->stop);
+  }
+}
+
+void time_transform(SRT_File &srt, const Time_Transform &transform)
+{
+  time_transform(srt.subtitles.begin(), srt.subtitles.end(), transform);
+}
+
+// The piecewise-linear map through `points`, as (from, to) sorted by from,
+// extended linearly past the first and last ones. A single point gives an
+// offset. Returns false unless both coordinates strictly increase.
+bool piecewise_linear(
+  const std::vector<std::pair<Time, Time>> &points,
+  Time_Transform &transform
+)
+{
+  if (points.size() == 1) {
+    transform = Time_Map{1.0, points[0].second - points[0].first};
+    return true;
+  }
+  transform.bounds.clear();
+  transform.maps.clear();
+  for (size_t i = 1; i < points.size(); ++i) {
+    auto [x0, y0] = points[i - 1];
+    auto [x1, y1] = points[i];
+    if (x1 <= x0 || y1 <= y0) {
+      return false;
+    }
+    double scale = (y1 - y0) / (x1 - x0);
+    if (i > 1) {
+      transform.bounds.push_back(x0);
+    }
+    transform.maps.push_back({scale, y0 - scale * x0});
+  }
+  return true;
+}
+// }}}
+
 struct ASS_Subtitle {
   int style;
   Time start, stop;
   std::string text;
+  int layer = 0;
+  int margin_v = 0;  // 0 for the style's margin.
+  // With --pair-cues, the cue(s) of the other track shown above `text`.
+  int paired_style = -1;
+  std::string paired_text;
+};
+
+struct ASS_Style {
+  std::string name;
+  std::string primary_colour;  // &HAABBGGRR.
+  int alignment;               // numpad layout: 2 bottom, 5 middle, 8 top.
+  int margin_v;
 };
 
+// Styles that can be picked by name. Bot and Top are the defaults of --bottom
+// and --top.
+const ASS_Style g_builtin_styles[] = {
+  {"Bot", "&H00F9FFF9", 2, 10},
+  {"Top", "&H00F9FFFF", 8, 10},
+  {"Mid", "&H0000FFFF", 5, 10},
+};
+
+// ASS_Subtitle::style indexes `styles`.
 struct ASS_File {
+  std::vector<ASS_Style> styles;
   std::vector<ASS_Subtitle> subtitles;
 };
 
@@ -94,239 +693,3892 @@ struct ASS_Subtitle_Comparator {
   }
 };
 
-void get_line(std::istream &in, std::string &dst)
+// Scans the line starting at p into `line` (without its line terminator) and
+// advances p past it. Returns false if the buffer ended before a '\n'.
+bool scan_line(const char *&p, const char *end, std::string_view &line)
 {
-  std::getline(in, dst);
-  if (!dst.empty()) {
-    if (dst.back() == '\r') {
-      dst = dst.substr(0, dst.size() - 1);
-    }
+  const char *nl = (const char *)std::memchr(p, '\n', end - p);
+  const char *line_end = nl ? nl : end;
+  line = std::string_view(p, line_end - p);
+  if (!line.empty() && line.back() == '\r') {
+    line.remove_suffix(1);
   }
+  p = nl ? nl + 1 : end;
+  return nl != nullptr;
 }
 
-SRT_File parse_srt_file(std::istream &in)
+enum class Cue_Result { ok, incomplete, end, malformed };
+
+// Parses the cue at p, skipping any blank lines in front of it. On success p
+// is advanced past the blank line that terminates the cue. When the buffer
+// ends before that blank line, the cue only counts as complete if at_eof is
+// set; otherwise `incomplete` is returned and p is left untouched, so the
+// caller can retry once more data has arrived. A cue without a valid time
+// line is `malformed`, and p is advanced to the next blank line, so parsing
+// can resume from there. If cue_begin is given, it receives the position of
+// the cue's number line.
+Cue_Result parse_srt_cue(
+  const char *&p,
+  const char *end,
+  bool at_eof,
+  SRT_Subtitle &sub,
+  const char **cue_begin = nullptr
+)
 {
-  SRT_File srt;
-  srt.subtitles.reserve(4096);
-  std::string line;
-  while (!in.eof()) {
-    SRT_Subtitle sub;
+  const char *q = p;
+  std::string_view line;
 
-    // Parse number
-    get_line(in, line);
-    if (in.eof() || line.empty()) {
-      break;
+  // Parse number
+  do {
+    if (q == end) {
+      if (!at_eof) {
+        return Cue_Result::incomplete;
+      }
+      p = q;
+      return Cue_Result::end;
     }
-    std::from_chars(line.data(), line.data() + line.size(), sub.num);
-
-    // Parse time info
-    get_line(in, line);
-    size_t s0 = line.find(' ');
-    size_t s1 = line.find(' ', s0 + 1);
-    if (s0 == std::string::npos || s1 == std::string::npos) {
-      break;
+    if (cue_begin) {
+      *cue_begin = q;
     }
-    sub.start = parse_time(std::string_view(line.data(), s0));
-    sub.stop =
-      parse_time(std::string_view(line.data() + s1 + 1, line.size() - s1 - 1));
-
-    // Get the lines of actual text.
-    do {
-      get_line(in, line);
-      if (line.empty()) {
-        break;
-      }
-      if (in.eof()) {
-        break;
-      }
-      if (sub.text.empty()) {
-        sub.text = std::move(line);
-      } else {
-        sub.text += "\n";
-        sub.text += line;
-      }
-    } while (true);
+    if (!scan_line(q, end, line) && !at_eof) {
+      return Cue_Result::incomplete;
+    }
+  } while (line.empty());
+  sub.num = 0;
+  std::from_chars(line.data(), line.data() + line.size(), sub.num);
 
-    // std::cout << "Parsed subtitle: " << sub.text << "\n";
+  // Parse time info
+  if (q == end) {
+    if (!at_eof) {
+      return Cue_Result::incomplete;
+    }
+    p = q;
+    return Cue_Result::malformed;
+  }
+  if (!scan_line(q, end, line) && !at_eof) {
+    return Cue_Result::incomplete;
+  }
+  size_t s0 = line.find(' ');
+  size_t s1 = line.find(' ', s0 + 1);
+  if (s0 == std::string::npos || s1 == std::string::npos
+      || line.find("-->") == std::string::npos) {
+    while (!line.empty() && q != end) {
+      scan_line(q, end, line);
+    }
+    p = q;
+    return Cue_Result::malformed;
+  }
+  sub.start = parse_time(line.substr(0, s0));
+  sub.stop = parse_time(line.substr(s1 + 1));
 
-    srt.subtitles.push_back(std::move(sub));
+  // Get the lines of actual text.
+  sub.text.clear();
+  bool terminated = false;
+  while (q != end) {
+    if (!scan_line(q, end, line) && !at_eof) {
+      return Cue_Result::incomplete;
+    }
+    if (line.empty()) {
+      terminated = true;
+      break;
+    }
+    if (!sub.text.empty()) {
+      sub.text += '\n';
+    }
+    sub.text.append(line);
   }
-  return srt;
+  if (!terminated && !at_eof) {
+    return Cue_Result::incomplete;
+  }
+  p = q;
+  return Cue_Result::ok;
 }
 
-void convert_encoding(SRT_File &srt, const char *from, const char *to)
+// Parses the complete cues in buf[begin, end) and appends them to `out`,
+// their times mapped through `transform`. If offsets is given, the byte offset
+// of every cue's number line is appended to it as well.
+void parse_srt_range(
+  std::string_view buf,
+  size_t begin,
+  size_t end,
+  std::vector<SRT_Subtitle> &out,
+  std::vector<size_t> *offsets = nullptr,
+  const Time_Transform &transform = {}
+)
 {
-  iconv_t cvt = iconv_open(to, from);
-  if (cvt == (iconv_t)-1) {
-    if (errno == EINVAL)
-      std::printf("Conversion from '%s' to '%s' not available\n", from, to);
-    else
-      perror("iconv_open");
-
-    exit(1);
-    return;
+  const size_t first = out.size();
+  const char *p = buf.data() + begin;
+  const char *e = buf.data() + end;
+  if (begin == 0 && buf.substr(0, 3) == "\xef\xbb\xbf") {
+    p += 3;  // UTF-8 byte order mark.
   }
-  for (size_t i = 0; i < srt.subtitles.size(); ++i) {
-    SRT_Subtitle &sub = srt.subtitles[i];
-    char out_buf[4096]{0};
-    char *out_buf_ptr = (char *)&out_buf;
-    char *in_buf;
-    size_t in_buf_size;
-    size_t out_buf_size;
-    in_buf = const_cast<char *>(sub.text.c_str());
-    in_buf_size = sub.text.size();
-    out_buf_size = sizeof(out_buf);
-    size_t result =
-      iconv(cvt, &in_buf, &in_buf_size, &out_buf_ptr, &out_buf_size);
-    if (result == (size_t)-1) {
-      std::cout << "Encoding conversion failed.\n";
-      exit(1);
-    }
-    sub.text = out_buf;
+  SRT_Subtitle sub;
+  const char *cue_begin = p;
+  Cue_Result result;
+  while ((result = parse_srt_cue(p, e, true, sub, &cue_begin))
+         != Cue_Result::end) {
+    if (result != Cue_Result::ok) {
+      continue;
+    }
+    if (offsets) {
+      offsets->push_back(cue_begin - buf.data());
+    }
+    out.push_back(std::move(sub));
+  }
+  if (!transform.is_identity()) {
+    time_transform(out.begin() + first, out.end(), transform);
   }
-  iconv_close(cvt);
 }
 
-void insert_srt_into_ass(ASS_File &ass, const SRT_File &srt, int style)
+unsigned g_threads = 0;  // worker threads; 0 for one per core.
+
+unsigned thread_count()
 {
-  for (size_t i = 0; i < srt.subtitles.size(); ++i) {
-    const SRT_Subtitle &sub = srt.subtitles[i];
-    ass.subtitles.push_back({style, sub.start, sub.stop, sub.text});
+  unsigned n = g_threads ? g_threads : std::thread::hardware_concurrency();
+  return std::max(n, 1u);
+}
+
+// Runs f(0) ... f(n - 1) on up to thread_count() threads, the calling one
+// included, and returns when all of them are done. If any f(i) throws, the
+// rest are skipped and the first exception is rethrown on the calling thread.
+template <typename F> void parallel_for(size_t n, const F &f)
+{
+  std::atomic<size_t> next{0};
+  std::mutex error_mutex;
+  std::exception_ptr error;
+  auto work = [&] {
+    try {
+      for (size_t i; (i = next++) < n;) {
+        f(i);
+      }
+    } catch (...) {
+      next = n;
+      std::lock_guard<std::mutex> lock(error_mutex);
+      if (!error) {
+        error = std::current_exception();
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t t = 1; t < std::min<size_t>(thread_count(), n); ++t) {
+    workers.push_back(traced_thread(work));
+  }
+  work();
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
   }
 }
 
-void time_shift(SRT_File &srt, double shift)
+// Returns the position just past the first blank line at or after pos, or
+// the end of buf. Every blank line ends a cue, so parsing can start there.
+size_t next_cue_boundary(std::string_view buf, size_t pos)
 {
-  for (size_t i = 0; i < srt.subtitles.size(); ++i) {
-    SRT_Subtitle &sub = srt.subtitles[i];
-    sub.start += shift;
-    sub.stop += shift;
+  for (size_t i = buf.find('\n', pos); i != std::string_view::npos;
+       i = buf.find('\n', i + 1)) {
+    size_t j = i + 1;
+    if (j < buf.size() && buf[j] == '\r') {
+      j++;
+    }
+    if (j < buf.size() && buf[j] == '\n') {
+      return j + 1;
+    }
   }
+  return buf.size();
 }
 
-void replace_all(
-  std::string &s,
-  std::string const &to_replace,
-  std::string const &replace_with
+// Parses buf in chunks of at least this size, one per thread, when it is
+// large enough.
+constexpr size_t parse_chunk_size = 1 << 20;
+
+SRT_File parse_srt_buffer(
+  std::string_view buf,
+  std::vector<size_t> *offsets = nullptr,
+  const Time_Transform &transform = {}
 )
 {
-  std::string buf;
-  std::size_t pos = 0;
-  std::size_t prevPos;
-
-  // Reserves rough estimate of final size of string.
-  buf.reserve(s.size());
+  SRT_File srt;
+  size_t chunks =
+    std::min<size_t>(thread_count(), buf.size() / parse_chunk_size);
+  if (chunks <= 1) {
+    srt.subtitles.reserve(4096);
+    parse_srt_range(buf, 0, buf.size(), srt.subtitles, offsets, transform);
+    return srt;
+  }
 
-  while (true) {
-    prevPos = pos;
-    pos = s.find(to_replace, pos);
-    if (pos == std::string::npos)
-      break;
-    buf.append(s, prevPos, pos - prevPos);
-    buf += replace_with;
-    pos += to_replace.size();
+  std::vector<size_t> bounds = {0};
+  for (size_t i = 1; i < chunks; ++i) {
+    size_t pos = std::max(i * buf.size() / chunks, bounds.back());
+    bounds.push_back(next_cue_boundary(buf, pos));
   }
+  bounds.push_back(buf.size());
+  std::vector<std::vector<SRT_Subtitle>> parts(chunks);
+  std::vector<std::vector<size_t>> part_offsets(chunks);
+  parallel_for(chunks, [&](size_t i) {
+    Trace_Scope trace("parse chunk");
+    parse_srt_range(
+      buf,
+      bounds[i],
+      bounds[i + 1],
+      parts[i],
+      offsets ? &part_offsets[i] : nullptr,
+      transform
+    );
+  });
 
-  buf.append(s, prevPos, s.size() - prevPos);
-  s.swap(buf);
+  size_t total = 0;
+  for (const std::vector<SRT_Subtitle> &part : parts) {
+    total += part.size();
+  }
+  srt.subtitles.reserve(total);
+  for (size_t i = 0; i < chunks; ++i) {
+    std::move(
+      parts[i].begin(), parts[i].end(), std::back_inserter(srt.subtitles)
+    );
+    if (offsets) {
+      offsets->insert(
+        offsets->end(), part_offsets[i].begin(), part_offsets[i].end()
+      );
+    }
+  }
+  return srt;
 }
 
-std::string text_to_ass_text(std::string text)
+void read_stream(std::istream &in, std::string &content)
 {
-  replace_all(text, "\r\n", "\n");
-  replace_all(text, "\n", "\\N");
-  replace_all(text, "<i>", "{\\i1}");
-  replace_all(text, "</i>", "{\\i0}");
-  replace_all(text, "<b>", "{\\b0}");
-  replace_all(text, "</b>", "{\\b0}");
-  return text;
+  char buf[65536];
+  while (in.read(buf, sizeof(buf)) || in.gcount() > 0) {
+    content.append(buf, in.gcount());
+  }
 }
 
-void write_ass_file(std::ostream &out, const ASS_File &ass)
+// Reads the whole file into `content`, with "-" meaning standard input.
+bool read_file(const std::string &filename, std::string &content)
 {
-  // clang-format off
-  out << "[Script Info]\r\n";
-  out << "ScriptType: v4.00+\r\n";
-  out << "Collisions: Normal\r\n";
-  out << "PlayDepth: 0\r\n";
-  out << "Timer: 100,0000\r\n";
+  if (filename == "-") {
+    content.clear();
+    read_stream(std::cin, content);
+    return true;
+  }
+  std::ifstream in(filename, std::ios::binary);
+  if (!in) {
+    return false;
+  }
+  in.seekg(0, std::ios::end);
+  content.resize(std::max<std::streamoff>(0, in.tellg()));
+  in.seekg(0, std::ios::beg);
+  in.read(content.data(), content.size());
+  content.resize(in.gcount());
+  return true;
+}
+
+// A read-only memory mapping of a regular file.
+struct Mapped_File {
+  const char *data = nullptr;
+  size_t size = 0;
+
+  Mapped_File() = default;
+  Mapped_File(const Mapped_File &) = delete;
+  Mapped_File &operator=(const Mapped_File &) = delete;
+
+  ~Mapped_File()
+  {
+    if (data) {
+      munmap((void *)data, size);
+    }
+  }
+
+  // Fails for stdin, and for files that are empty or not regular.
+  bool map(const std::string &filename)
+  {
+    if (filename == "-") {
+      return false;
+    }
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    void *addr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (addr == MAP_FAILED) {
+      return false;
+    }
+    madvise(addr, st.st_size, MADV_WILLNEED);
+    data = (const char *)addr;
+    size = st.st_size;
+    return true;
+  }
+
+  std::string_view view() const { return {data, size}; }
+};
+
+// Other input formats {{{
+// Like the SRT parser, these scan the file buffer in place and produce cues
+// with SRT markup (\n line breaks, <i> and <b> tags), so that the rest of the
+// pipeline doesn't care where a track came from.
+
+std::string_view trim(std::string_view s)
+{
+  size_t begin = s.find_first_not_of(" \t");
+  if (begin == std::string_view::npos) {
+    return {};
+  }
+  return s.substr(begin, s.find_last_not_of(" \t") - begin + 1);
+}
+
+std::string_view skip_bom(std::string_view buf)
+{
+  return buf.substr(0, 3) == "\xef\xbb\xbf" ? buf.substr(3) : buf;
+}
+
+// Parses a clock time "[H:]MM:SS[.fraction]", as in WebVTT and ASS, with up
+// to 6 decimals. A comma is accepted as decimal separator too. Returns false
+// if `view` is none.
+bool parse_clock_time(std::string_view view, Time &t)
+{
+  const char *p = view.data();
+  const char *end = p + view.size();
+  int fields[3];
+  int n = 0;
+  while (true) {
+    auto result = std::from_chars(p, end, fields[n]);
+    if (result.ec != std::errc()) {
+      return false;
+    }
+    p = result.ptr;
+    n++;
+    if (p == end || *p != ':' || n == 3) {
+      break;
+    }
+    p++;
+  }
+  if (n < 2) {
+    return false;
+  }
+  Time seconds = n == 3 ? fields[0] * 3600 + fields[1] * 60 + fields[2]
+                        : fields[0] * 60 + fields[1];
+  if (p != end) {
+    if (*p != '.' && *p != ',') {
+      return false;
+    }
+    const char *digits = ++p;
+    int fraction;
+    auto result = std::from_chars(p, end, fraction);
+    if (result.ec != std::errc() || result.ptr != end || end - digits > 6) {
+      return false;
+    }
+    // Nudged up by a microsecond, so that append_ass_time(), which
+    // truncates, doesn't print 2.90 as 2.89.
+    seconds += fraction / std::pow(10.0, end - digits) + 1e-6;
+  }
+  t = seconds;
+  return true;
+}
+
+// WebVTT cue text to SRT markup: <i> and <b> are kept, other tags (classes,
+// voices, timestamps) dropped and entities decoded.
+void append_vtt_text_as_srt(std::string &out, std::string_view line)
+{
+  static const std::pair<std::string_view, char> entities[] = {
+    {"&amp;", '&'}, {"&lt;", '<'}, {"&gt;", '>'}, {"&nbsp;", ' '}
+  };
+  for (size_t i = 0; i < line.size(); ++i) {
+    char c = line[i];
+    if (c == '<') {
+      size_t close = line.find('>', i);
+      if (close == std::string_view::npos) {
+        break;
+      }
+      std::string_view tag = line.substr(i, close - i + 1);
+      if (tag == "<i>" || tag == "</i>" || tag == "<b>" || tag == "</b>") {
+        out.append(tag);
+      }
+      i = close;
+      continue;
+    }
+    if (c == '&') {
+      bool decoded = false;
+      for (const auto &[entity, replacement] : entities) {
+        if (line.compare(i, entity.size(), entity) == 0) {
+          out += replacement;
+          i += entity.size() - 1;
+          decoded = true;
+          break;
+        }
+      }
+      if (decoded) {
+        continue;
+      }
+    }
+    out += c;
+  }
+}
+
+// WebVTT: blocks separated by blank lines, after the WEBVTT header block.
+// Blocks without a timing line (NOTE, STYLE, REGION) are skipped, as are cue
+// settings.
+void parse_vtt_buffer(
+  std::string_view buf,
+  double,
+  std::vector<SRT_Subtitle> &out
+)
+{
+  buf = skip_bom(buf);
+  const char *p = buf.data();
+  const char *end = p + buf.size();
+  std::string_view line;
+  do {
+    scan_line(p, end, line);
+  } while (p != end && !line.empty());
+
+  SRT_Subtitle sub;
+  int number = 0;
+  while (p != end) {
+    scan_line(p, end, line);
+    if (line.empty()) {
+      continue;
+    }
+    if (line.find("-->") == std::string_view::npos && p != end) {
+      scan_line(p, end, line);  // the first line was the cue identifier.
+    }
+    if (line.find("-->") == std::string_view::npos) {
+      while (p != end && !line.empty()) {
+        scan_line(p, end, line);
+      }
+      continue;
+    }
+    size_t arrow = line.find("-->");
+    std::string_view stop = trim(line.substr(arrow + 3));
+    stop = stop.substr(0, stop.find_first_of(" \t"));
+    bool valid = parse_clock_time(trim(line.substr(0, arrow)), sub.start)
+                 && parse_clock_time(stop, sub.stop);
+    sub.text.clear();
+    while (p != end) {
+      scan_line(p, end, line);
+      if (line.empty()) {
+        break;
+      }
+      if (!sub.text.empty()) {
+        sub.text += '\n';
+      }
+      append_vtt_text_as_srt(sub.text, line);
+    }
+    if (valid) {
+      sub.num = ++number;
+      out.push_back(std::move(sub));
+    }
+  }
+}
+
+// ASS event text to SRT markup: \N and \n become line breaks, \h a space,
+// and italic and bold overrides tags. Other override blocks are dropped.
+void append_ass_text_as_srt(std::string &out, std::string_view text)
+{
+  static const std::pair<std::string_view, std::string_view> overrides[] = {
+    {"\\i1", "<i>"}, {"\\i0", "</i>"}, {"\\b1", "<b>"}, {"\\b0", "</b>"}
+  };
+  for (size_t i = 0; i < text.size(); ++i) {
+    char c = text[i];
+    char next = i + 1 < text.size() ? text[i + 1] : '\0';
+    if (c == '\\' && (next == 'N' || next == 'n' || next == 'h')) {
+      out += next == 'h' ? ' ' : '\n';
+      i++;
+    } else if (c == '{') {
+      size_t close = text.find('}', i);
+      if (close == std::string_view::npos) {
+        break;
+      }
+      std::string_view block = text.substr(i + 1, close - i - 1);
+      for (size_t k = block.find('\\'); k != std::string_view::npos;
+           k = block.find('\\', k + 1)) {
+        for (const auto &[tag, replacement] : overrides) {
+          if (block.compare(k, tag.size(), tag) == 0) {
+            out += replacement;
+          }
+        }
+      }
+      i = close;
+    } else {
+      out += c;
+    }
+  }
+}
+
+// ASS and SSA: the Dialogue lines of the [Events] section, with the field
+// layout taken from its Format line. Styles and positioning are not kept.
+void parse_ass_buffer(
+  std::string_view buf,
+  double,
+  std::vector<SRT_Subtitle> &out
+)
+{
+  buf = skip_bom(buf);
+  const char *p = buf.data();
+  const char *end = p + buf.size();
+  std::string_view line;
+  bool in_events = false;
+  size_t start_field = 1, stop_field = 2, text_field = 9;
+  std::vector<std::string_view> fields;
+  SRT_Subtitle sub;
+  int number = 0;
+  while (p != end) {
+    scan_line(p, end, line);
+    line = trim(line);
+    if (!line.empty() && line[0] == '[') {
+      in_events = line == "[Events]";
+      continue;
+    }
+    bool format = line.substr(0, 7) == "Format:";
+    if (!in_events || (!format && line.substr(0, 9) != "Dialogue:")) {
+      continue;
+    }
+    line.remove_prefix(format ? 7 : 9);
+
+    // Only split off as many fields as Format has: the text may contain
+    // commas.
+    fields.clear();
+    while (fields.size() < (format ? SIZE_MAX : text_field)) {
+      size_t comma = line.find(',');
+      if (comma == std::string_view::npos) {
+        break;
+      }
+      fields.push_back(trim(line.substr(0, comma)));
+      line.remove_prefix(comma + 1);
+    }
+    fields.push_back(format ? trim(line) : line);
+
+    if (format) {
+      for (size_t i = 0; i < fields.size(); ++i) {
+        if (fields[i] == "Start") {
+          start_field = i;
+        } else if (fields[i] == "End") {
+          stop_field = i;
+        } else if (fields[i] == "Text") {
+          text_field = i;
+        }
+      }
+      continue;
+    }
+    if (fields.size() <= text_field
+        || !parse_clock_time(fields[start_field], sub.start)
+        || !parse_clock_time(fields[stop_field], sub.stop)) {
+      continue;
+    }
+    sub.num = ++number;
+    sub.text.clear();
+    append_ass_text_as_srt(sub.text, fields[text_field]);
+    out.push_back(std::move(sub));
+  }
+}
+
+// MicroDVD text to SRT markup: | separates lines, and the {y:i} and {y:b}
+// codes (or {Y:...}, for all following lines) become tags. Other control
+// codes are dropped.
+void append_microdvd_text_as_srt(std::string &out, std::string_view text)
+{
+  bool all_italic = false;
+  bool all_bold = false;
+  size_t line_start = 0;
+  while (true) {
+    size_t bar = text.find('|', line_start);
+    std::string_view line = text.substr(line_start, bar - line_start);
+    bool italic = all_italic;
+    bool bold = all_bold;
+    while (!line.empty() && line[0] == '{') {
+      size_t close = line.find('}');
+      if (close == std::string_view::npos) {
+        break;
+      }
+      std::string_view code = line.substr(1, close - 1);
+      if (code.size() > 2 && (code[0] == 'y' || code[0] == 'Y')
+          && code[1] == ':') {
+        bool i = code.find('i', 2) != std::string_view::npos;
+        bool b = code.find('b', 2) != std::string_view::npos;
+        italic |= i;
+        bold |= b;
+        if (code[0] == 'Y') {
+          all_italic |= i;
+          all_bold |= b;
+        }
+      }
+      line.remove_prefix(close + 1);
+    }
+    if (line_start > 0) {
+      out += '\n';
+    }
+    out += bold ? "<b>" : "";
+    out += italic ? "<i>" : "";
+    out.append(line);
+    out += italic ? "</i>" : "";
+    out += bold ? "</b>" : "";
+    if (bar == std::string_view::npos) {
+      break;
+    }
+    line_start = bar + 1;
+  }
+}
+
+// Parses "{frame}" at the start of `line` and removes it.
+bool take_frame(std::string_view &line, long &frame)
+{
+  if (line.empty() || line[0] != '{') {
+    return false;
+  }
+  const char *end = line.data() + line.size();
+  auto result = std::from_chars(line.data() + 1, end, frame);
+  if (result.ec != std::errc() || result.ptr == end || *result.ptr != '}') {
+    return false;
+  }
+  line.remove_prefix(result.ptr + 1 - line.data());
+  return true;
+}
+
+// MicroDVD: "{start}{stop}text" lines, in frames. Unless fps is given, a
+// first line "{1}{1}FPS" sets the frame rate, or 23.976 is assumed.
+void parse_microdvd_buffer(
+  std::string_view buf,
+  double fps,
+  std::vector<SRT_Subtitle> &out
+)
+{
+  buf = skip_bom(buf);
+  const char *p = buf.data();
+  const char *end = p + buf.size();
+  std::string_view line;
+  SRT_Subtitle sub;
+  int number = 0;
+  while (p != end) {
+    scan_line(p, end, line);
+    long start, stop;
+    if (!take_frame(line, start) || !take_frame(line, stop)) {
+      continue;
+    }
+    double header_fps = 0.0;
+    if (number == 0 && start == 1 && stop == 1
+        && std::from_chars(line.data(), line.data() + line.size(), header_fps)
+               .ptr
+             == line.data() + line.size()) {
+      if (fps <= 0.0) {
+        fps = header_fps;
+      }
+      continue;
+    }
+    if (fps <= 0.0) {
+      fps = 23.976;
+    }
+    sub.num = ++number;
+    sub.start = start / fps;
+    sub.stop = stop / fps;
+    sub.text.clear();
+    append_microdvd_text_as_srt(sub.text, line);
+    out.push_back(std::move(sub));
+  }
+}
+
+struct Input_Format {
+  const char *name;
+  const char *description;
+  // Whether the start of a file, past any byte order mark and blank space,
+  // looks like this format.
+  bool (*sniff)(std::string_view head);
+  void (*parse)(
+    std::string_view buf,
+    double fps,
+    std::vector<SRT_Subtitle> &out
+  );
+};
+
+// In sniffing order; SRT comes last, as the fallback.
+const Input_Format g_input_formats[] = {
+  {"vtt",
+   "WebVTT",
+   [](std::string_view head) { return head.substr(0, 6) == "WEBVTT"; },
+   parse_vtt_buffer},
+  {"ass",
+   "ASS/SSA",
+   [](std::string_view head) {
+     // Only by its first section: "[Events]" could well be in an SRT cue.
+     return head.substr(0, 13) == "[Script Info]";
+   },
+   parse_ass_buffer},
+  {"microdvd",
+   "MicroDVD",
+   [](std::string_view head) {
+     long frame;
+     return take_frame(head, frame) && take_frame(head, frame);
+   },
+   parse_microdvd_buffer},
+  {"srt",
+   "SRT",
+   [](std::string_view) { return true; },
+   [](std::string_view buf, double, std::vector<SRT_Subtitle> &out) {
+     parse_srt_range(buf, 0, buf.size(), out);
+   }},
+};
+const Input_Format *const g_srt_format = &g_input_formats[3];
+
+const Input_Format *find_input_format(const std::string &name)
+{
+  for (const Input_Format &format : g_input_formats) {
+    if (name == format.name) {
+      return &format;
+    }
+  }
+  return nullptr;
+}
+
+const Input_Format &sniff_input_format(std::string_view buf)
+{
+  std::string_view head = skip_bom(buf).substr(0, 4096);
+  head.remove_prefix(std::min(head.find_first_not_of(" \t\r\n"), head.size()));
+  for (const Input_Format &format : g_input_formats) {
+    if (format.sniff(head)) {
+      return format;
+    }
+  }
+  return *g_srt_format;
+}
+
+// Parses a subtitle file of any format, with its times mapped through
+// `transform`. `offsets` is only filled in for SRT.
+SRT_File parse_subtitles(
+  std::string_view buf,
+  const Input_Format &format,
+  double fps,
+  std::vector<size_t> *offsets = nullptr,
+  const Time_Transform &transform = {}
+)
+{
+  if (&format == g_srt_format) {
+    return parse_srt_buffer(buf, offsets, transform);
+  }
+  SRT_File srt;
+  srt.subtitles.reserve(4096);
+  format.parse(buf, fps, srt.subtitles);
+  if (!transform.is_identity()) {
+    time_transform(srt, transform);
+  }
+  return srt;
+}
+// }}}
+
+iconv_t open_converter(const char *from, const char *to)
+{
+  iconv_t cvt = iconv_open(to, from);
+  if (cvt == (iconv_t)-1) {
+    if (errno == EINVAL) {
+      throw std::runtime_error(
+        std::string("Conversion from '") + from + "' to '" + to
+        + "' not available."
+      );
+    }
+    throw std::runtime_error(std::string("iconv_open: ") + strerror(errno));
+  }
+  return cvt;
+}
+
+void convert_text(iconv_t cvt, std::string &text)
+{
+  char out_buf[4096]{0};
+  char *out_buf_ptr = (char *)&out_buf;
+  char *in_buf;
+  size_t in_buf_size;
+  size_t out_buf_size;
+  in_buf = const_cast<char *>(text.c_str());
+  in_buf_size = text.size();
+  out_buf_size = sizeof(out_buf);
+  size_t result =
+    iconv(cvt, &in_buf, &in_buf_size, &out_buf_ptr, &out_buf_size);
+  if (result == (size_t)-1) {
+    throw std::runtime_error("Encoding conversion failed.");
+  }
+  text = out_buf;
+}
+
+void convert_encoding(SRT_File &srt, const char *from, const char *to)
+{
+  iconv_t cvt = open_converter(from, to);
+  try {
+    for (size_t i = 0; i < srt.subtitles.size(); ++i) {
+      convert_text(cvt, srt.subtitles[i].text);
+    }
+  } catch (...) {
+    iconv_close(cvt);
+    throw;
+  }
+  iconv_close(cvt);
+}
+
+// The indices of the cues of `srt` in start time order, or nothing if they
+// are in order already. Tracks are merged through this index rather than
+// sorted, so that their cues stay in file order (which watch mode relies on).
+std::vector<uint32_t> start_order(const SRT_File &srt)
+{
+  const std::vector<SRT_Subtitle> &subs = srt.subtitles;
+  auto by_start = [&](uint32_t l, uint32_t r) {
+    return subs[l].start < subs[r].start;
+  };
+  std::vector<uint32_t> order(subs.size());
+  std::iota(order.begin(), order.end(), 0);
+  if (std::is_sorted(order.begin(), order.end(), by_start)) {
+    return {};
+  }
+  std::stable_sort(order.begin(), order.end(), by_start);
+  return order;
+}
+
+// Appends the tracks to ass.subtitles in start time order, track i getting
+// style i, with a k-way heap merge. Ties go to the lower track.
+void merge_tracks(ASS_File &ass, const std::vector<const SRT_File *> &tracks)
+{
+  std::vector<std::vector<uint32_t>> orders(tracks.size());
+  size_t total = 0;
+  for (size_t i = 0; i < tracks.size(); ++i) {
+    total += tracks[i]->subtitles.size();
+    orders[i] = start_order(*tracks[i]);
+  }
+  auto cue = [&](size_t track, size_t pos) -> const SRT_Subtitle & {
+    const std::vector<uint32_t> &order = orders[track];
+    return tracks[track]->subtitles[order.empty() ? pos : order[pos]];
+  };
+
+  struct Head {
+    Time start;
+    size_t track;
+    size_t pos;
+  };
+  auto later = [](const Head &l, const Head &r) {
+    return l.start != r.start ? l.start > r.start : l.track > r.track;
+  };
+  std::vector<Head> heap;
+  for (size_t i = 0; i < tracks.size(); ++i) {
+    if (!tracks[i]->subtitles.empty()) {
+      heap.push_back({cue(i, 0).start, i, 0});
+    }
+  }
+  std::make_heap(heap.begin(), heap.end(), later);
+  ass.subtitles.reserve(ass.subtitles.size() + total);
+  while (!heap.empty()) {
+    std::pop_heap(heap.begin(), heap.end(), later);
+    Head &head = heap.back();
+    const SRT_Subtitle &sub = cue(head.track, head.pos);
+    ass.subtitles.push_back({(int)head.track, sub.start, sub.stop, sub.text});
+    if (++head.pos < tracks[head.track]->subtitles.size()) {
+      head.start = cue(head.track, head.pos).start;
+      std::push_heap(heap.begin(), heap.end(), later);
+    } else {
+      heap.pop_back();
+    }
+  }
+}
+
+// Pairs every cue of `top` with the cue of `bottom` it overlaps most, found
+// with a sweep over both tracks in start time order, and appends one event
+// per bottom cue with its top cues above it, spanning them all. Top cues
+// that overlap no bottom cue get an event of their own.
+void pair_tracks(ASS_File &ass, const SRT_File &bottom, const SRT_File &top)
+{
+  const std::vector<uint32_t> bottom_order = start_order(bottom);
+  const std::vector<uint32_t> top_order = start_order(top);
+  auto bottom_cue = [&](size_t pos) -> const SRT_Subtitle & {
+    return bottom.subtitles[bottom_order.empty() ? pos : bottom_order[pos]];
+  };
+  auto top_cue = [&](size_t pos) -> const SRT_Subtitle & {
+    return top.subtitles[top_order.empty() ? pos : top_order[pos]];
+  };
+  const size_t nb = bottom.subtitles.size();
+  const size_t nt = top.subtitles.size();
+
+  // partner[j]: position of the bottom cue the j-th top cue goes with, or nb.
+  std::vector<uint32_t> partner(nt, nb);
+  std::vector<uint32_t> first(nb + 1, 0);
+  size_t lo = 0;
+  for (size_t j = 0; j < nt; ++j) {
+    const SRT_Subtitle &t = top_cue(j);
+    while (lo < nb && bottom_cue(lo).stop <= t.start) {
+      lo++;
+    }
+    Time best = 0.0;
+    for (size_t i = lo; i < nb && bottom_cue(i).start < t.stop; ++i) {
+      const SRT_Subtitle &b = bottom_cue(i);
+      Time overlap = std::min(b.stop, t.stop) - std::max(b.start, t.start);
+      if (overlap > best) {
+        best = overlap;
+        partner[j] = i;
+      }
+    }
+    first[partner[j]]++;
+  }
+  // The top cues of each bottom cue, grouped by a counting sort.
+  for (size_t i = 0, sum = 0; i <= nb; ++i) {
+    size_t count = first[i];
+    first[i] = sum;
+    sum += count;
+  }
+  std::vector<uint32_t> grouped(nt);
+  {
+    std::vector<uint32_t> next(first.begin(), first.end() - 1);
+    next.push_back(first[nb]);
+    for (size_t j = 0; j < nt; ++j) {
+      grouped[next[partner[j]]++] = j;
+    }
+  }
+
+  const size_t begin = ass.subtitles.size();
+  ass.subtitles.reserve(begin + nb + (nt - first[nb]));
+  for (size_t i = 0; i < nb; ++i) {
+    const SRT_Subtitle &b = bottom_cue(i);
+    ass.subtitles.push_back({0, b.start, b.stop, b.text});
+    ASS_Subtitle &event = ass.subtitles.back();
+    for (size_t k = first[i]; k < first[i + 1]; ++k) {
+      const SRT_Subtitle &t = top_cue(grouped[k]);
+      event.start = std::min(event.start, t.start);
+      event.stop = std::max(event.stop, t.stop);
+      if (!event.paired_text.empty()) {
+        event.paired_text += '\n';
+      }
+      event.paired_text += t.text;
+      event.paired_style = 1;
+    }
+  }
+  for (size_t k = first[nb]; k < nt; ++k) {
+    const SRT_Subtitle &t = top_cue(grouped[k]);
+    ass.subtitles.push_back({1, t.start, t.stop, t.text});
+  }
+  auto events = ass.subtitles.begin() + begin;
+  if (!std::is_sorted(events, ass.subtitles.end(), ASS_Subtitle_Comparator())) {
+    std::stable_sort(events, ass.subtitles.end(), ASS_Subtitle_Comparator());
+  }
+}
+
+// Converts SRT markup to ASS in a single pass, appending to `out`: line
+// breaks become \N and <i>/<b> tags become override blocks.
+void append_ass_text(std::string &out, std::string_view text)
+{
+  static const std::pair<std::string_view, std::string_view> tags[] = {
+    {"<i>", "{\\i1}"},
+    {"</i>", "{\\i0}"},
+    {"<b>", "{\\b0}"},
+    {"</b>", "{\\b0}"},
+  };
+  size_t run = 0;  // start of the pending run of verbatim characters.
+  for (size_t i = 0; i < text.size(); ++i) {
+    char c = text[i];
+    bool crlf = c == '\r' && i + 1 < text.size() && text[i + 1] == '\n';
+    if (c == '\n' || crlf) {
+      out.append(text, run, i - run);
+      out += "\\N";
+      i += crlf;
+      run = i + 1;
+    } else if (c == '<') {
+      for (const auto &[tag, replacement] : tags) {
+        if (text.compare(i, tag.size(), tag) == 0) {
+          out.append(text, run, i - run);
+          out += replacement;
+          i += tag.size() - 1;
+          run = i + 1;
+          break;
+        }
+      }
+    }
+  }
+  out.append(text, run, text.size() - run);
+}
+
+std::string text_to_ass_text(std::string text)
+{
+  std::string out;
+  out.reserve(text.size() + 16);
+  append_ass_text(out, text);
+  return out;
+}
+
+void write_ass_header(std::ostream &out, const std::vector<ASS_Style> &styles)
+{
+  // clang-format off
+  out << "[Script Info]\r\n";
+  out << "ScriptType: v4.00+\r\n";
+  out << "Collisions: Normal\r\n";
+  out << "PlayDepth: 0\r\n";
+  out << "Timer: 100,0000\r\n";
   out << "Video Aspect Ratio: 0\r\n";
   out << "WrapStyle: 0\r\n";
   out << "ScaledBorderAndShadow: no\r\n";
   out << "\r\n";
   out << "[V4+ Styles]\r\n";
   out << "Format: Name,Fontname,Fontsize,PrimaryColour,SecondaryColour,OutlineColour,BackColour,Bold,Italic,Underline,StrikeOut,ScaleX,ScaleY,Spacing,Angle,BorderStyle,Outline,Shadow,Alignment,MarginL,MarginR,MarginV,Encoding\r\n";
-  //out << "Style: Default,Arial,16,&H00FFFFFF,&H00FFFFFF,&H00000000,&H00000000,-1,0,0,0,100,100,0,0,1,3,0,2,10,10,10,0\r\n";
-  out << "Style: Top,Arial,16,&H00F9FFFF,&H00FFFFFF,&H00000000,&H00000000,-1,0,0,0,100,100,0,0,1,3,0,8,10,10,10,0\r\n";
-  //out << "Style: Mid,Arial,16,&H0000FFFF,&H00FFFFFF,&H00000000,&H00000000,-1,0,0,0,100,100,0,0,1,3,0,5,10,10,10,0\r\n";
-  out << "Style: Bot,Arial,16,&H00F9FFF9,&H00FFFFFF,&H00000000,&H00000000,-1,0,0,0,100,100,0,0,1,3,0,2,10,10,10,0\r\n";
+  // Last track first, which for the bottom and top tracks is the Top, Bot
+  // order that the header has always had.
+  for (auto it = styles.rbegin(); it != styles.rend(); ++it) {
+    const ASS_Style &style = *it;
+    out << "Style: " << style.name << ",Arial,16," << style.primary_colour
+        << ",&H00FFFFFF,&H00000000,&H00000000,-1,0,0,0,100,100,0,0,1,3,0,"
+        << style.alignment << ",10,10," << style.margin_v << ",0\r\n";
+  }
   out << "\r\n";
   out << "[Events]\r\n";
   out << "Format: Layer, Start, End, Style, Name, MarginL, MarginR, MarginV, Effect, Text\r\n";
   // clang-format on
+}
+
+void append_ass_event(
+  std::string &buf,
+  const ASS_Subtitle &sub,
+  const std::vector<ASS_Style> &styles
+)
+{
+  char num[16];
+  buf += "Dialogue: ";
+  buf.append(num, std::to_chars(num, num + sizeof(num), sub.layer).ptr);
+  buf += ',';
+  append_ass_time(buf, sub.start);
+  buf += ',';
+  append_ass_time(buf, sub.stop);
+  buf += ',';
+  buf += styles[sub.style].name;
+  if (sub.margin_v == 0) {
+    buf += ",,0000,0000,0000,,";
+  } else {
+    std::snprintf(num, sizeof(num), "%04d", std::clamp(sub.margin_v, 1, 9999));
+    buf += ",,0000,0000,";
+    buf += num;
+    buf += ",,";
+  }
+  if (sub.paired_style >= 0) {
+    buf += "{\\r";
+    buf += styles[sub.paired_style].name;
+    buf += '}';
+    append_ass_text(buf, sub.paired_text);
+    buf += "\\N{\\r}";
+  }
+  append_ass_text(buf, sub.text);
+  buf += "\r\n";
+}
+
+// Output formats {{{
+// Appends t as HH:MM:SS, `separator` and milliseconds, the way SRT, WebVTT and
+// TTML write times. Negative times are clamped to 0.
+void append_clock_time(std::string &out, Time t, char separator)
+{
+  long long ms = std::llround(std::max(t, 0.0) * 1000.0);
+  long long hours = ms / 3600000;
+  if (hours < 100) {
+    int minutes = ms / 60000 % 60;
+    int seconds = ms / 1000 % 60;
+    int millis = ms % 1000;
+    char buf[12] = {
+      char('0' + hours / 10),
+      char('0' + hours % 10),
+      ':',
+      char('0' + minutes / 10),
+      char('0' + minutes % 10),
+      ':',
+      char('0' + seconds / 10),
+      char('0' + seconds % 10),
+      separator,
+      char('0' + millis / 100),
+      char('0' + millis / 10 % 10),
+      char('0' + millis % 10),
+    };
+    out.append(buf, sizeof(buf));
+    return;
+  }
+  char buf[40];
+  int len = std::snprintf(
+    buf,
+    sizeof(buf),
+    "%lld:%02lld:%02lld%c%03lld",
+    hours,
+    ms / 60000 % 60,
+    ms / 1000 % 60,
+    separator,
+    ms % 1000
+  );
+  out.append(buf, len);
+}
+
+// Converts SRT markup for the XML-like formats: line breaks become
+// `line_break`, <i> and <b> become open[0] and open[1] (and their closing
+// tags close[0] and close[1]), and anything else is escaped. A closing tag
+// also closes the tags opened inside it; stray ones are dropped and open ones
+// closed at the end, so that the result is well-formed.
+void append_markup_text(
+  std::string &out,
+  std::string_view text,
+  const char *line_break,
+  const char *const open[2],
+  const char *const close[2]
+)
+{
+  static const std::string_view tags[4] = {"<i>", "<b>", "</i>", "</b>"};
+  int open_tags[16];
+  int depth = 0;
+  for (size_t i = 0; i < text.size(); ++i) {
+    char c = text[i];
+    if (c == '<') {
+      int k = 0;
+      while (k < 4 && text.compare(i, tags[k].size(), tags[k]) != 0) {
+        k++;
+      }
+      if (k < 2 && depth < 16) {
+        out += open[k];
+        open_tags[depth++] = k;
+      } else if (k >= 2 && std::count(open_tags, open_tags + depth, k - 2)) {
+        while (open_tags[depth - 1] != k - 2) {
+          out += close[open_tags[--depth]];
+        }
+        out += close[open_tags[--depth]];
+      }
+      if (k < 4) {
+        i += tags[k].size() - 1;
+        continue;
+      }
+    }
+    switch (c) {
+      case '\n': out += line_break; break;
+      case '\r': break;
+      case '<': out += "&lt;"; break;
+      case '>': out += "&gt;"; break;
+      case '&': out += "&amp;"; break;
+      default: out += c; break;
+    }
+  }
+  while (depth > 0) {
+    out += close[open_tags[--depth]];
+  }
+}
+
+// "&HAABBGGRR", as ASS writes colours, to "#RRGGBB".
+std::string ass_colour_to_rgb(const std::string &colour)
+{
+  std::string bgr =
+    colour.size() >= 6 ? colour.substr(colour.size() - 6) : "FFFFFF";
+  return "#" + bgr.substr(4, 2) + bgr.substr(2, 2) + bgr.substr(0, 2);
+}
+
+void write_vtt_header(std::ostream &out, const std::vector<ASS_Style> &styles)
+{
+  out << "WEBVTT\n\nSTYLE\n";
+  for (const ASS_Style &style : styles) {
+    out << "::cue(." << style.name
+        << ") { color: " << ass_colour_to_rgb(style.primary_colour) << "; }\n";
+  }
+  out << "\n";
+}
+
+void append_vtt_event(
+  std::string &buf,
+  const ASS_Subtitle &sub,
+  const std::vector<ASS_Style> &styles,
+  size_t
+)
+{
+  static const char *const open[2] = {"<i>", "<b>"};
+  static const char *const close[2] = {"</i>", "</b>"};
+  const ASS_Style &style = styles[sub.style];
+  append_clock_time(buf, sub.start, '.');
+  buf += " --> ";
+  append_clock_time(buf, sub.stop, '.');
+  switch ((style.alignment - 1) / 3) {
+    case 1: buf += " line:50%,center"; break;
+    case 2: buf += " line:0"; break;
+  }
+  buf += '\n';
+  if (sub.paired_style >= 0) {
+    buf += "<c.";
+    buf += styles[sub.paired_style].name;
+    buf += '>';
+    append_markup_text(buf, sub.paired_text, "\n", open, close);
+    buf += "</c>\n";
+  }
+  buf += "<c.";
+  buf += style.name;
+  buf += '>';
+  append_markup_text(buf, sub.text, "\n", open, close);
+  buf += "</c>\n\n";
+}
+
+// SRT has no styles; non-default positions are kept through the {\anN} tag
+// that most players understand.
+void append_srt_event(
+  std::string &buf,
+  const ASS_Subtitle &sub,
+  const std::vector<ASS_Style> &styles,
+  size_t number
+)
+{
+  char num[24];
+  buf.append(num, std::to_chars(num, num + sizeof(num), number).ptr);
+  buf += "\r\n";
+  append_clock_time(buf, sub.start, ',');
+  buf += " --> ";
+  append_clock_time(buf, sub.stop, ',');
+  buf += "\r\n";
+  int alignment = styles[sub.style].alignment;
+  if (alignment != 2) {
+    buf += "{\\an";
+    buf += char('0' + alignment % 10);
+    buf += '}';
+  }
+  auto append_lines = [&](const std::string &text) {
+    for (char c : text) {
+      if (c == '\n') {
+        buf += "\r\n";
+      } else {
+        buf += c;
+      }
+    }
+    buf += "\r\n";
+  };
+  if (sub.paired_style >= 0) {
+    append_lines(sub.paired_text);
+  }
+  append_lines(sub.text);
+  buf += "\r\n";
+}
+
+void write_ttml_header(std::ostream &out, const std::vector<ASS_Style> &styles)
+{
+  static const char *const display_align[3] = {"after", "center", "before"};
+  static const char *const text_align[3] = {"end", "start", "center"};
+  out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+  out << "<tt xmlns=\"http://www.w3.org/ns/ttml\" "
+         "xmlns:tts=\"http://www.w3.org/ns/ttml#styling\">\n";
+  out << "  <head>\n    <styling>\n";
+  for (const ASS_Style &style : styles) {
+    out << "      <style xml:id=\"" << style.name << "\" tts:color=\""
+        << ass_colour_to_rgb(style.primary_colour)
+        << "\" tts:fontFamily=\"Arial\" tts:fontWeight=\"bold\"/>\n";
+  }
+  out << "    </styling>\n    <layout>\n";
+  for (const ASS_Style &style : styles) {
+    int row = std::clamp((style.alignment - 1) / 3, 0, 2);
+    out << "      <region xml:id=\"" << style.name
+        << ".region\" tts:origin=\"10% 10%\" tts:extent=\"80% 80%\" "
+           "tts:displayAlign=\""
+        << display_align[row] << "\" tts:textAlign=\""
+        << text_align[style.alignment % 3] << "\"/>\n";
+  }
+  out << "    </layout>\n  </head>\n  <body>\n    <div>\n";
+}
+
+void append_ttml_event(
+  std::string &buf,
+  const ASS_Subtitle &sub,
+  const std::vector<ASS_Style> &styles,
+  size_t
+)
+{
+  static const char *const open[2] = {
+    "<span tts:fontStyle=\"italic\">", "<span tts:fontWeight=\"bold\">"
+  };
+  static const char *const close[2] = {"</span>", "</span>"};
+  const std::string &style = styles[sub.style].name;
+  buf += "      <p begin=\"";
+  append_clock_time(buf, sub.start, '.');
+  buf += "\" end=\"";
+  append_clock_time(buf, sub.stop, '.');
+  buf += "\" region=\"";
+  buf += style;
+  buf += ".region\" style=\"";
+  buf += style;
+  buf += "\">";
+  if (sub.paired_style >= 0) {
+    buf += "<span style=\"";
+    buf += styles[sub.paired_style].name;
+    buf += "\">";
+    append_markup_text(buf, sub.paired_text, "<br/>", open, close);
+    buf += "</span><br/>";
+  }
+  append_markup_text(buf, sub.text, "<br/>", open, close);
+  buf += "</p>\n";
+}
+
+struct Output_Format {
+  const char *name;  // also the file extension.
+  void (*write_header)(std::ostream &out, const std::vector<ASS_Style> &);
+  void (*append_event)(
+    std::string &buf,
+    const ASS_Subtitle &sub,
+    const std::vector<ASS_Style> &styles,
+    size_t number  // of the event, from 1.
+  );
+  const char *footer;
+};
+
+const Output_Format g_output_formats[] = {
+  {"ass",
+   write_ass_header,
+   [](
+     std::string &buf,
+     const ASS_Subtitle &sub,
+     const std::vector<ASS_Style> &styles,
+     size_t
+   ) { append_ass_event(buf, sub, styles); },
+   ""},
+  {"vtt", write_vtt_header, append_vtt_event, ""},
+  {"srt",
+   [](std::ostream &, const std::vector<ASS_Style> &) {},
+   append_srt_event,
+   ""},
+  {"ttml",
+   write_ttml_header,
+   append_ttml_event,
+   "    </div>\n  </body>\n</tt>\n"},
+};
+
+// Picks the format of an output from a "FORMAT:" prefix, which is stripped
+// off `filename`, or else from its extension. Defaults to ASS.
+const Output_Format &output_format(std::string &filename)
+{
+  for (const Output_Format &format : g_output_formats) {
+    size_t len = std::strlen(format.name);
+    if (filename.compare(0, len, format.name) == 0 && filename[len] == ':') {
+      filename.erase(0, len + 1);
+      return format;
+    }
+  }
+  std::string ext = std::filesystem::path(filename).extension();
+  for (char &c : ext) {
+    c = std::tolower((unsigned char)c);
+  }
+  if (ext == ".xml" || ext == ".dfxp") {
+    ext = ".ttml";
+  }
+  for (const Output_Format &format : g_output_formats) {
+    if (ext.size() > 1 && ext.compare(1, std::string::npos, format.name) == 0) {
+      return format;
+    }
+  }
+  return g_output_formats[0];
+}
+
+// An output file and its format; several of them can be written from one run.
+struct Output {
+  const Output_Format *format;
+  std::string filename;
+};
+
+// Writes the events and the footer; the header is written separately.
+void write_events(
+  std::ostream &out,
+  const Output_Format &format,
+  const ASS_File &ass
+)
+{
+  // Format the events into a buffer that is flushed in large blocks, rather
+  // than going through the stream for every field.
+  std::string buf;
+  buf.reserve(1 << 16);
+  for (size_t i = 0; i < ass.subtitles.size(); ++i) {
+    format.append_event(buf, ass.subtitles[i], ass.styles, i + 1);
+    if (buf.size() >= (1 << 16) - 1024) {
+      out.write(buf.data(), buf.size());
+      buf.clear();
+    }
+  }
+  buf += format.footer;
+  out.write(buf.data(), buf.size());
+}
+
+void write_subtitles(
+  std::ostream &out,
+  const Output_Format &format,
+  const ASS_File &ass
+)
+{
+  format.write_header(out, ass.styles);
+  write_events(out, format, ass);
+}
+
+void write_ass_file(std::ostream &out, const ASS_File &ass)
+{
+  write_subtitles(out, g_output_formats[0], ass);
+}
+// }}}
+
+// Collision resolver {{{
+// Places events that are shown at the same time as another event of their
+// style, instead of leaving that to the renderer. For top and bottom aligned
+// styles, an event is stacked through MarginV at the least distance from the
+// edge where it clears the events of its style still shown, going by their
+// number of lines, and the n-th simultaneous event goes on layer n (renderers
+// only detect collisions within a layer). Middle aligned events, which can't
+// be stacked from an edge, and events that would be stacked off the screen
+// stay on layer 0 for the renderer to lay out. Events must be fed in start
+// time order.
+struct Collision_Resolver {
+  // As write_ass_header() sets them, on the default 288 pixel high script.
+  static constexpr int font_size = 16;
+  static constexpr int outline = 3;
+  static constexpr int script_height = 288;
+
+  struct Shown {
+    Time stop;
+    int slot;
+    int low, high;  // the MarginV range it takes up.
+  };
+  struct Lane {
+    std::vector<Shown> shown;  // min-heap on stop.
+    std::vector<int> free;     // min-heap of slots no longer in use.
+    int slots = 0;
+  };
+
+  const std::vector<ASS_Style> &styles;
+  std::vector<Lane> lanes;
+  std::vector<std::pair<int, int>> taken;  // scratch space for place().
+
+  explicit Collision_Resolver(const std::vector<ASS_Style> &styles)
+    : styles(styles), lanes(styles.size())
+  {
+  }
+
+  static int height(const ASS_Subtitle &sub)
+  {
+    int lines = 1 + std::count(sub.text.begin(), sub.text.end(), '\n');
+    if (sub.paired_style >= 0) {
+      lines +=
+        1 + std::count(sub.paired_text.begin(), sub.paired_text.end(), '\n');
+    }
+    return lines * font_size * 5 / 4 + 2 * outline;
+  }
+
+  void place(ASS_Subtitle &sub)
+  {
+    const ASS_Style &style = styles[sub.style];
+    if ((style.alignment - 1) / 3 == 1) {
+      return;  // middle aligned.
+    }
+    auto ends_later = [](const Shown &l, const Shown &r) {
+      return l.stop > r.stop;
+    };
+    Lane &lane = lanes[sub.style];
+    while (!lane.shown.empty() && lane.shown.front().stop <= sub.start) {
+      lane.free.push_back(lane.shown.front().slot);
+      std::push_heap(lane.free.begin(), lane.free.end(), std::greater<int>());
+      std::pop_heap(lane.shown.begin(), lane.shown.end(), ends_later);
+      lane.shown.pop_back();
+    }
+
+    // The lowest margin at which the event fits between the shown ones.
+    taken.clear();
+    for (const Shown &shown : lane.shown) {
+      taken.push_back({shown.low, shown.high});
+    }
+    std::sort(taken.begin(), taken.end());
+    const int h = height(sub);
+    int margin = style.margin_v;
+    for (const auto &[low, high] : taken) {
+      if (margin + h <= low) {
+        break;
+      }
+      margin = std::max(margin, high);
+    }
+    if (margin + h > script_height) {
+      return;  // off the screen.
+    }
+
+    int slot = lane.slots;
+    if (lane.free.empty()) {
+      lane.slots++;
+    } else {
+      std::pop_heap(lane.free.begin(), lane.free.end(), std::greater<int>());
+      slot = lane.free.back();
+      lane.free.pop_back();
+    }
+    lane.shown.push_back({sub.stop, slot, margin, margin + h});
+    std::push_heap(lane.shown.begin(), lane.shown.end(), ends_later);
+
+    sub.layer = slot;
+    sub.margin_v = margin != style.margin_v ? margin : 0;
+  }
+};
+
+void resolve_collisions(ASS_File &ass)
+{
+  Collision_Resolver resolver(ass.styles);
+  for (ASS_Subtitle &sub : ass.subtitles) {
+    resolver.place(sub);
+  }
+}
+// }}}
+
+// The start and stop times of a track in start time order, with a grid of
+// 1 s buckets over them for finding the cue that starts closest to a time
+// without a binary search. Built once per track for all the shifts that
+// auto-sync tries.
+struct Start_Index {
+  Time origin = 0.0;            // start of bucket 0.
+  std::vector<Time> starts;     // sorted.
+  std::vector<Time> stops;      // of the same cues.
+  std::vector<uint32_t> first;  // per bucket: the first cue starting in it or
+                                // later; one extra at the end.
+
+  // The position of the first cue that starts at `t` or later.
+  size_t lower_bound(Time t) const
+  {
+    double bucket = std::floor(t - origin);
+    if (!(bucket >= 0.0)) {
+      return 0;
+    }
+    if (bucket >= first.size() - 1) {
+      return starts.size();
+    }
+    size_t i = first[(size_t)bucket];
+    while (i < starts.size() && starts[i] < t) {
+      i++;
+    }
+    return i;
+  }
+
+  // The position of the cue that starts closest to `t` among those that
+  // start at `min_start` or later, the first one on ties; starts.size() if
+  // there's none.
+  size_t nearest(Time t, Time min_start) const
+  {
+    size_t i = lower_bound(t);
+    if (i == 0 || starts[i - 1] < min_start) {
+      return i;
+    }
+    if (i < starts.size() && starts[i] - t < t - starts[i - 1]) {
+      return i;
+    }
+    size_t j = i - 1;
+    while (j > 0 && starts[j - 1] == starts[j]) {
+      j--;
+    }
+    return j;
+  }
+};
+
+// The index of the cue times of `srt` as mapped through `transform`, which
+// keeps their order.
+Start_Index build_start_index(
+  const SRT_File &srt,
+  const Time_Transform &transform = {}
+)
+{
+  Start_Index index;
+  const std::vector<uint32_t> order = start_order(srt);
+  const size_t n = srt.subtitles.size();
+  index.starts.reserve(n);
+  index.stops.reserve(n);
+  size_t segment = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const SRT_Subtitle &sub = srt.subtitles[order.empty() ? i : order[i]];
+    segment = transform.segment(sub.start, segment);
+    index.starts.push_back(transform.maps[segment](sub.start));
+    index.stops.push_back(
+      transform.maps[transform.segment(sub.stop, segment)](sub.stop)
+    );
+  }
+  if (n == 0) {
+    index.first.assign(1, 0);
+    return index;
+  }
+  index.origin = std::floor(index.starts.front());
+  size_t buckets = (size_t)(index.starts.back() - index.origin) + 1;
+  index.first.resize(buckets + 1);
+  size_t i = 0;
+  for (size_t k = 0; k <= buckets; ++k) {
+    while (i < n && index.starts[i] < index.origin + k) {
+      i++;
+    }
+    index.first[k] = i;
+  }
+  return index;
+}
+
+// How the errors of the matched cues add up to the cost of a shift. Plain L1
+// lets a few cues without a counterpart (songs, signs, credits) dominate; the
+// others bound their influence.
+enum class Sync_Cost {
+  l1,         // sum of the errors.
+  truncated,  // sum of the errors, each capped at 2 s.
+  huber,      // quadratic up to 1 s, linear beyond.
+  trimmed,    // sum of the errors, leaving out the worst 10%.
+};
+
+const char *const g_sync_cost_names[] = {"l1", "truncated", "huber", "trimmed"};
+
+// The cost of aligning `a` to `b` shifted by offset_b: for every cue of `a`,
+// the error of the start and stop of the cue of `b` that starts closest to it
+// (and no earlier than 4 s before it). Costs never decrease as cues are added,
+// so the evaluation gives up as soon as it exceeds `bound`, and returns the
+// partial cost.
+double alignment_distance(
+  const Start_Index &a,
+  const Start_Index &b,
+  double offset_b,
+  Sync_Cost cost = Sync_Cost::l1,
+  double bound = std::numeric_limits<double>::infinity()
+)
+{
+  // For the trimmed cost: a min-heap of the largest errors so far, which are
+  // left out. Dropping the largest k of the errors so far can only leave out
+  // less than dropping the largest k of them all, so the sum of the others is
+  // a lower bound of the final cost too.
+  std::vector<double> worst;
+  size_t trim = 0;
+  double worst_sum = 0.0;
+  if (cost == Sync_Cost::trimmed) {
+    trim = a.starts.size() / 10;
+    worst.reserve(trim + 1);
+  }
+
+  const double search_window = 8.0; // seconds.
+  double distance = 0.0;
+  for (size_t idx_a = 0; idx_a < a.starts.size(); ++idx_a) {
+    Time start = a.starts[idx_a] - offset_b;
+    Time stop = a.stops[idx_a] - offset_b;
+    size_t idx_b = b.nearest(start, start - search_window * 0.5);
+    if (idx_b == b.starts.size()) {
+      continue;
+    }
+    double error =
+      std::abs(b.starts[idx_b] - start) + std::abs(b.stops[idx_b] - stop);
+    switch (cost) {
+      case Sync_Cost::l1: distance += error; break;
+      case Sync_Cost::truncated: distance += std::min(error, 2.0); break;
+      case Sync_Cost::huber:
+        distance += error <= 1.0 ? 0.5 * error * error : error - 0.5;
+        break;
+      case Sync_Cost::trimmed:
+        distance += error;
+        if (trim == 0) {
+          break;
+        }
+        if (worst.size() < trim) {
+          worst.push_back(error);
+          std::push_heap(worst.begin(), worst.end(), std::greater<double>());
+          worst_sum += error;
+        } else if (error > worst.front()) {
+          std::pop_heap(worst.begin(), worst.end(), std::greater<double>());
+          worst_sum += error - worst.back();
+          worst.back() = error;
+          std::push_heap(worst.begin(), worst.end(), std::greater<double>());
+        }
+        break;
+    }
+    if (distance - worst_sum > bound) {
+      break;
+    }
+  }
+  return distance - worst_sum;
+}
+
+// A deterministic sample of about `fraction` of the cues of `index`, spread
+// evenly over time: the first cue at or after the middle of each of as many
+// equal spans of the track.
+Start_Index sample_start_index(const Start_Index &index, double fraction)
+{
+  Start_Index sample;
+  const size_t n = index.starts.size();
+  if (n == 0) {
+    return sample;
+  }
+  const size_t strata = std::clamp<size_t>(std::ceil(n * fraction), 1, n);
+  const Time begin = index.starts.front();
+  const Time span = (index.starts.back() - begin) / strata;
+  size_t last = n;
+  for (size_t k = 0; k < strata; ++k) {
+    size_t i = index.lower_bound(begin + (k + 0.5) * span);
+    if (i < n && i != last) {
+      sample.starts.push_back(index.starts[i]);
+      sample.stops.push_back(index.stops[i]);
+      last = i;
+    }
+  }
+  return sample;
+}
+
+struct Timing_Sync_Options {
+  Sync_Cost cost = Sync_Cost::l1;
+  // If in (0, 1), the fraction of the cues the shifts are scored on, after
+  // which only the best few are scored on all of them.
+  double sample = 0.0;
+  // If positive, the search stops after this long with the best shift so
+  // far.
+  double time_budget_ms = 0.0;
+  // If any, shifts found for earlier tracks like this one: only the shifts
+  // within prior_window seconds of them are searched, and the ones 1 s
+  // apart elsewhere, for the confidence.
+  std::vector<double> priors;
+  double prior_window = 0.5;
+};
+
+// What auto-sync found for a track, for --sync-report and
+// --min-sync-confidence.
+struct Sync_Report {
+  std::string track;
+  std::string reference;
+  const char *method = "timing";
+  Time_Map map;
+  // From 0 when another, separate minimum is as good as the best one, to 1
+  // when the best one is clearly better than any other.
+  double confidence = 1.0;
+  double basin_width = 0.0;  // seconds, of the shifts close to the best one.
+
+  struct Point {
+    double shift;
+    double cost;  // estimated with --sync-sample.
+    bool pruned;  // then `cost` is only a lower bound.
+  };
+  std::vector<Point> curve;  // of the timing search, by shift.
+};
+
+// The cost margin, beyond that of the best shift, that makes another shift
+// clearly worse: twice the best cost plus 0.1 s per cue, so that it doesn't
+// vanish when the best cost is about 0.
+double clear_cost(double best_cost, size_t cues)
+{
+  return 2.0 * best_cost + 0.1 * cues;
+}
+
+// Fills in the confidence and basin width of `report` from its cost curve:
+// the basin is the run of shifts around the best one that are not clearly
+// worse, and the confidence is how far the lowest cost outside of it is from
+// the best one, up to clearly worse. It is 0 if the best shift is at the edge
+// of the curve, or if the basin takes up all of it: the actual offset is then
+// likely out of the searched range.
+void measure_confidence(Sync_Report &report, double best_shift, size_t cues)
+{
+  std::vector<Sync_Report::Point> &curve = report.curve;
+  std::sort(curve.begin(), curve.end(), [](const auto &l, const auto &r) {
+    return l.shift < r.shift;
+  });
+  size_t best = 0;
+  while (best < curve.size() && curve[best].shift != best_shift) {
+    best++;
+  }
+  if (best == curve.size()) {
+    return;
+  }
+  const double cost = curve[best].cost;
+  const double clear = clear_cost(cost, cues);
+  auto in_basin = [&](const Sync_Report::Point &point) {
+    return !point.pruned && point.cost < clear;
+  };
+  size_t lo = best, hi = best;
+  while (lo > 0 && in_basin(curve[lo - 1])) {
+    lo--;
+  }
+  while (hi + 1 < curve.size() && in_basin(curve[hi + 1])) {
+    hi++;
+  }
+  report.basin_width = curve[hi].shift - curve[lo].shift;
+  if (best == 0 || best + 1 == curve.size()
+      || (lo == 0 && hi + 1 == curve.size())) {
+    report.confidence = 0.0;
+    return;
+  }
+  double second = std::numeric_limits<double>::infinity();
+  for (size_t i = 0; i < curve.size(); ++i) {
+    if (i < lo || i > hi) {
+      second = std::min(second, curve[i].cost);
+    }
+  }
+  report.confidence = std::clamp((second - cost) / (clear - cost), 0.0, 1.0);
+}
+
+// Searches the shift within +-10 s, in steps of 0.05 s, that best aligns
+// `track` to `reference`, logging a line per evaluated shift at debug level.
+// With options.priors, the search starts at the first one.
+//
+// The search is anytime: it tries the shifts 1 s apart first, then refines
+// to 0.5, 0.25 and 0.05 s, each time starting from around the best shift so
+// far, so that it can stop at the time budget with a good one. Shifts whose
+// cost exceeds the best one part way through are pruned. Ties go to the
+// earlier shift.
+//
+// With a `report`, the cost curve is recorded and the confidence measured.
+// Shifts are then only pruned once clearly worse than the best one (see
+// clear_cost), beyond which the confidence doesn't change.
+double find_best_shift(
+  const Start_Index &reference_index,
+  const Start_Index &track_index,
+  size_t &evaluations,
+  const Timing_Sync_Options &options = {},
+  Sync_Report *report = nullptr
+)
+{
+  const bool sampled = options.sample > 0.0 && options.sample < 1.0;
+  Start_Index reference_sample, track_sample;
+  if (sampled) {
+    reference_sample = sample_start_index(reference_index, options.sample);
+    track_sample = sample_start_index(track_index, options.sample);
+  }
+  const Start_Index &reference_queries =
+    sampled ? reference_sample : reference_index;
+  const Start_Index &track_queries = sampled ? track_sample : track_index;
+  // Sampled costs are scaled up to estimates of the full ones.
+  const double reference_scale = reference_queries.starts.empty()
+    ? 1.0
+    : (double)reference_index.starts.size() / reference_queries.starts.size();
+  const double track_scale = track_queries.starts.empty()
+    ? 1.0
+    : (double)track_index.starts.size() / track_queries.starts.size();
+
+  std::vector<double> shifts;
+  for (double shift = -10.0; shift <= 10.001; shift += 0.05) {
+    shifts.push_back(shift);
+  }
+  // Shifts left out of the search are marked done from the start. With
+  // priors, the shifts near them are searched first, so that the others are
+  // pruned early, and then the ones 1 s apart.
+  std::vector<bool> done(shifts.size(), false);
+  std::vector<bool> near_prior(shifts.size(), false);
+  size_t candidates = shifts.size();
+  size_t start = shifts.size() / 2;
+  std::vector<size_t> strides = {20, 10, 5, 1};
+  if (!options.priors.empty()) {
+    strides = {1, 20};
+    for (size_t i = 0; i < shifts.size(); ++i) {
+      double nearest = std::numeric_limits<double>::infinity();
+      for (double prior : options.priors) {
+        nearest = std::min(nearest, std::abs(shifts[i] - prior));
+      }
+      near_prior[i] = nearest <= options.prior_window + 1e-6;
+      if (!near_prior[i] && i % 20 != 0) {
+        done[i] = true;
+        candidates--;
+      }
+      if (std::abs(shifts[i] - options.priors[0])
+          < std::abs(shifts[start] - options.priors[0])) {
+        start = i;
+      }
+    }
+  }
+  using Clock = std::chrono::steady_clock;
+  const Clock::time_point deadline = Clock::now()
+    + std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double, std::milli>(options.time_budget_ms)
+      );
+  auto out_of_time = [&] {
+    return options.time_budget_ms > 0.0 && Clock::now() >= deadline;
+  };
+
+  // The best `keep` shifts so far, as (estimated cost, index in shifts).
+  const size_t keep = sampled ? 5 : 1;
+  const size_t cues = reference_index.starts.size() + track_index.starts.size();
+  std::vector<std::pair<double, size_t>> best;
+  size_t pruned = 0;
+  size_t searched = 0;
+  double step = 0.0;  // of the last level searched completely.
+  bool stopped = false;
+  for (size_t stride : strides) {
+    std::vector<size_t> level;
+    for (size_t i = 0; i < shifts.size(); i += stride) {
+      if (!done[i] && (step > 0.0 || options.priors.empty() || near_prior[i])) {
+        level.push_back(i);
+      }
+    }
+    size_t center = best.empty() ? start : best[0].second;
+    std::stable_sort(level.begin(), level.end(), [&](size_t l, size_t r) {
+      return (l > center ? l - center : center - l)
+        < (r > center ? r - center : center - r);
+    });
+    for (size_t i : level) {
+      if (out_of_time()) {
+        stopped = true;
+        break;
+      }
+      Trace_Scope trace("evaluate shift");
+      done[i] = true;
+      searched++;
+      double shift = shifts[i];
+      double bound = best.size() < keep
+        ? std::numeric_limits<double>::infinity()
+        : report ? clear_cost(best.back().first, cues)
+                 : best.back().first;
+      double bound_A = bound / reference_scale;
+      double distance_A = reference_scale
+        * alignment_distance(
+            reference_queries, track_index, shift, options.cost, bound_A
+          );
+      double distance_B = 0.0;
+      if (distance_A <= bound) {
+        double bound_B = (bound - distance_A) / track_scale;
+        distance_B = track_scale
+          * alignment_distance(
+              track_queries, reference_index, -shift, options.cost, bound_B
+            );
+      }
+      evaluations++;
+      if (report) {
+        report->curve.push_back(
+          {shift, distance_A + distance_B, distance_A + distance_B > bound}
+        );
+      }
+      if (distance_A + distance_B > bound) {
+        pruned++;
+        log_printf(
+          Log_Level::debug,
+          "  Attempting shift %+6.2f seconds... Distance: > %.1f\n",
+          shift,
+          bound
+        );
+        continue;
+      }
+      log_printf(
+        Log_Level::debug,
+        "  Attempting shift %+6.2f seconds... Distance: %8.1f | %8.1f\n",
+        shift,
+        distance_A,
+        distance_B
+      );
+      std::pair<double, size_t> entry(distance_A + distance_B, i);
+      auto it = std::upper_bound(best.begin(), best.end(), entry);
+      if (it == best.end() && best.size() >= keep) {
+        continue;
+      }
+      best.insert(it, entry);
+      if (best.size() > keep) {
+        best.pop_back();
+      }
+    }
+    if (stopped) {
+      if (step > 0.0) {
+        log_printf(
+          Log_Level::info,
+          "  Out of time after %zu of %zu shifts (complete down to steps of "
+          "%.2f seconds).\n",
+          searched,
+          candidates,
+          step
+        );
+      } else {
+        log_printf(
+          Log_Level::info,
+          "  Out of time after %zu of %zu shifts.\n",
+          searched,
+          candidates
+        );
+      }
+      break;
+    }
+    step = stride * 0.05;
+  }
+  g_metrics.shifts_pruned += pruned;
+  if (best.empty()) {
+    return 0.0;
+  }
+  if (!sampled) {
+    if (report) {
+      measure_confidence(*report, shifts[best[0].second], cues);
+    }
+    return shifts[best[0].second];
+  }
+
+  // Re-score the best estimates on all the cues, time permitting.
+  log_printf(
+    Log_Level::verbose,
+    "  Scored on %zu + %zu of %zu + %zu cues; re-scoring the best %zu:\n",
+    reference_queries.starts.size(),
+    track_queries.starts.size(),
+    reference_index.starts.size(),
+    track_index.starts.size(),
+    best.size()
+  );
+  double best_exact = std::numeric_limits<double>::infinity();
+  size_t best_index = best[0].second;
+  for (const auto &[estimate, i] : best) {
+    if (out_of_time()) {
+      Log(Log_Level::info)
+        << "  Out of time; keeping the best estimate re-scored so far.\n";
+      break;
+    }
+    double exact =
+      alignment_distance(reference_index, track_index, shifts[i], options.cost)
+      + alignment_distance(
+        track_index, reference_index, -shifts[i], options.cost
+      );
+    evaluations++;
+    log_printf(
+      Log_Level::verbose,
+      "  Shift %+6.2f seconds: estimated %8.1f, exact %8.1f\n",
+      shifts[i],
+      estimate,
+      exact
+    );
+    if (exact < best_exact || (exact == best_exact && i < best_index)) {
+      best_exact = exact;
+      best_index = i;
+    }
+  }
+  if (report) {
+    measure_confidence(*report, shifts[best_index], cues);
+  }
+  return shifts[best_index];
+}
+
+double find_best_shift(
+  const SRT_File &reference,
+  const SRT_File &track,
+  size_t &evaluations,
+  const Timing_Sync_Options &options = {},
+  Sync_Report *report = nullptr
+)
+{
+  return find_best_shift(
+    build_start_index(reference),
+    build_start_index(track),
+    evaluations,
+    options,
+    report
+  );
+}
+
+// Anchor sync {{{
+// Syncs on cues that share tokens which tend to survive translation, rather
+// than on timing alone, so that it also works for large offsets, frame rate
+// drift and tracks that are segmented differently.
+
+uint64_t fnv1a(std::string_view s, uint64_t hash = 14695981039346656037ull)
+{
+  for (unsigned char c : s) {
+    hash = (hash ^ c) * 1099511628211ull;
+  }
+  return hash;
+}
+
+// Appends the hashes of the tokens of a cue: numbers, capitalized words
+// (mostly names), music notes, and its pattern of ? ! and … punctuation
+// (leaving out Spanish ¿ and ¡, which other languages lack). Tags are
+// skipped. Returns the length of the text in code points.
+size_t append_cue_tokens(std::string_view text, std::vector<uint64_t> &out)
+{
+  std::string punctuation;
+  size_t length = 0;
+  for (size_t i = 0; i < text.size();) {
+    unsigned char c = text[i];
+    if (c == '<') {
+      size_t close = text.find('>', i);
+      i = close == std::string_view::npos ? text.size() : close + 1;
+      continue;
+    }
+    if (std::isdigit(c)) {
+      size_t j = i;
+      while (j < text.size() && std::isdigit((unsigned char)text[j])) {
+        j++;
+      }
+      out.push_back(fnv1a(text.substr(i, j - i), fnv1a("#")));
+      length += j - i;
+      i = j;
+      continue;
+    }
+    if (std::isupper(c)) {
+      // Letters, including any non-ASCII ones.
+      size_t j = i + 1;
+      while (j < text.size()
+             && (std::isalpha((unsigned char)text[j]) || text[j] & 0x80)) {
+        j++;
+      }
+      if (j - i >= 3) {
+        out.push_back(fnv1a(text.substr(i, j - i), fnv1a("A")));
+      }
+      length += j - i;
+      i = j;
+      continue;
+    }
+    if (text.compare(i, 3, "♪") == 0 || text.compare(i, 3, "♫") == 0) {
+      punctuation += "♪";
+    } else if (
+      text.compare(i, 3, "…") == 0 || text.compare(i, 3, "...") == 0
+    ) {
+      punctuation += "…";
+      i += 2;
+    } else if (c == '?' || c == '!') {
+      punctuation += c;
+    }
+    length += (c & 0xc0) != 0x80;
+    i++;
+  }
+  if (!punctuation.empty()) {
+    out.push_back(fnv1a(punctuation, fnv1a("P")));
+  }
+  return length;
+}
+
+// Maps every token of a track to the cues that contain it.
+using Token_Index = std::unordered_map<uint64_t, std::vector<uint32_t>>;
+
+Token_Index build_token_index(const SRT_File &srt)
+{
+  Token_Index index;
+  std::vector<size_t> lengths;
+  std::vector<uint64_t> tokens;
+  lengths.reserve(srt.subtitles.size());
+  for (uint32_t i = 0; i < srt.subtitles.size(); ++i) {
+    tokens.clear();
+    lengths.push_back(append_cue_tokens(srt.subtitles[i].text, tokens));
+    std::sort(tokens.begin(), tokens.end());
+    tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+    for (uint64_t token : tokens) {
+      index[token].push_back(i);
+    }
+  }
+
+  // The rhythm of long and short cues carries over too, as long as the
+  // tracks are segmented alike: a token for the (coarse) length ratios with
+  // the previous and next cue.
+  auto ratio = [&](size_t a, size_t b) {
+    return (int)std::lround(
+      2.0 * std::log2((lengths[a] + 1.0) / (lengths[b] + 1.0))
+    );
+  };
+  for (uint32_t i = 1; i + 1 < lengths.size(); ++i) {
+    int pattern[2] = {ratio(i - 1, i), ratio(i, i + 1)};
+    std::string_view bytes((const char *)pattern, sizeof(pattern));
+    index[fnv1a(bytes, fnv1a("L"))].push_back(i);
+  }
+  return index;
+}
+
+struct Anchor {
+  Time from;  // start of the cue in the track being synced.
+  Time to;    // start of the matching cue in the reference.
+  double weight;
+};
+
+// Pairs up the cues of `track` and `reference` that share a token, at their
+// times mapped through `track_map` and `reference_map`. Tokens that would
+// pair up more than max_pairs cues are too common to tell anything. Rarer
+// tokens weigh more.
+std::vector<Anchor> match_anchors(
+  const SRT_File &reference,
+  const Token_Index &reference_index,
+  const Time_Transform &reference_map,
+  const SRT_File &track,
+  const Token_Index &track_index,
+  const Time_Transform &track_map
+)
+{
+  const size_t max_pairs = 64;
+  std::vector<Anchor> anchors;
+  for (const auto &[token, cues] : track_index) {
+    auto it = reference_index.find(token);
+    if (it == reference_index.end()
+        || cues.size() * it->second.size() > max_pairs) {
+      continue;
+    }
+    double weight = 1.0 / (cues.size() * it->second.size());
+    for (uint32_t i : cues) {
+      for (uint32_t j : it->second) {
+        anchors.push_back(
+          {track_map(track.subtitles[i].start),
+           reference_map(reference.subtitles[j].start),
+           weight}
+        );
+      }
+    }
+  }
+  // The hash map's order isn't meaningful; make the result deterministic.
+  std::sort(
+    anchors.begin(),
+    anchors.end(),
+    [](const Anchor &l, const Anchor &r) {
+      return l.from != r.from ? l.from < r.from : l.to < r.to;
+    }
+  );
+  return anchors;
+}
+
+struct Anchor_Sync_Result {
+  Time_Map map;
+  size_t anchors = 0;
+  double inlier_weight = 0.0;
+  size_t inliers = 0;
+  // As for the timing search: how much better the map scores than any
+  // hypothesis more than 1 s away from it, from 0 (as good) to 1 (twice).
+  double confidence = 0.0;
+};
+
+// Estimates the time map from the anchors with RANSAC: hypotheses from
+// single anchors (pure offsets) and from pairs of anchors far apart (offset
+// and scale) are scored by the weight of the anchors they put within
+// `tolerance`, and the best one is refit on its inliers. A scale only wins
+// if it explains clearly more than the best pure offset.
+Anchor_Sync_Result estimate_time_map(const std::vector<Anchor> &anchors)
+{
+  const double tolerance = 0.5;  // seconds.
+  const int iterations = 400;
+  Anchor_Sync_Result result;
+  result.anchors = anchors.size();
+  if (anchors.empty()) {
+    return result;
+  }
+
+  // Score on a bounded sample to keep this linear in the number of anchors.
+  const size_t stride = std::max<size_t>(1, anchors.size() / 20000);
+  auto score = [&](const Time_Map &map) {
+    double weight = 0.0;
+    for (size_t i = 0; i < anchors.size(); i += stride) {
+      if (std::abs(map(anchors[i].from) - anchors[i].to) < tolerance) {
+        weight += anchors[i].weight;
+      }
+    }
+    return weight;
+  };
+
+  uint64_t state = 0x9e3779b97f4a7c15ull;
+  auto random_index = [&] {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (size_t)(state % anchors.size());
+  };
+  Time_Map best_offset, best_affine;
+  double best_offset_score = -1.0, best_affine_score = -1.0;
+  std::vector<std::pair<Time_Map, double>> hypotheses;  // with their score.
+  for (int k = 0; k < iterations; ++k) {
+    const Anchor &a = anchors[random_index()];
+    Time_Map offset{1.0, a.to - a.from};
+    double offset_score = score(offset);
+    hypotheses.push_back({offset, offset_score});
+    if (offset_score > best_offset_score) {
+      best_offset = offset;
+      best_offset_score = offset_score;
+    }
+    const Anchor &b = anchors[random_index()];
+    if (std::abs(b.from - a.from) < 60.0) {
+      continue;
+    }
+    double scale = (b.to - a.to) / (b.from - a.from);
+    if (scale < 0.9 || scale > 1.1) {
+      continue;  // beyond any frame rate conversion.
+    }
+    Time_Map affine{scale, a.to - scale * a.from};
+    double affine_score = score(affine);
+    hypotheses.push_back({affine, affine_score});
+    if (affine_score > best_affine_score) {
+      best_affine = affine;
+      best_affine_score = affine_score;
+    }
+  }
+  bool affine = best_affine_score > 1.2 * best_offset_score;
+  Time_Map map = affine ? best_affine : best_offset;
+  // Hypotheses that disagree with the map by more than 1 s half way through
+  // the anchors are the alternatives it is compared with.
+  const double best_score = affine ? best_affine_score : best_offset_score;
+  const Time middle = anchors[anchors.size() / 2].from;
+  double second = 0.0;
+  for (const auto &[hypothesis, hypothesis_score] : hypotheses) {
+    if (std::abs(hypothesis(middle) - map(middle)) > 1.0) {
+      second = std::max(second, hypothesis_score);
+    }
+  }
+  result.confidence = second > 0.0
+    ? std::clamp(best_score / second - 1.0, 0.0, 1.0)
+    : 1.0;
+
+  // Refit on the inliers: weighted least squares for an affine map, the
+  // weighted mean offset otherwise.
+  double sw = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+  for (const Anchor &anchor : anchors) {
+    if (std::abs(map(anchor.from) - anchor.to) >= tolerance) {
+      continue;
+    }
+    double w = anchor.weight;
+    sw += w;
+    sx += w * anchor.from;
+    sy += w * anchor.to;
+    sxx += w * anchor.from * anchor.from;
+    sxy += w * anchor.from * anchor.to;
+    result.inliers++;
+  }
+  result.inlier_weight = sw;
+  double det = sw * sxx - sx * sx;
+  if (affine && result.inliers >= 2 && det > 1e-9) {
+    map.scale = (sw * sxy - sx * sy) / det;
+    map.shift = (sy - map.scale * sx) / sw;
+  } else if (sw > 0) {
+    map.shift = (sy - sx) / sw;
+  }
+  result.map = map;
+  return result;
+}
+
+// Finds the map from `track` to `reference` through shared tokens, with
+// their times mapped through `track_map` and `reference_map`. Returns false
+// if too few anchors agree to trust the result.
+bool anchor_sync(
+  const SRT_File &reference,
+  const SRT_File &track,
+  Anchor_Sync_Result &result,
+  const Time_Transform &reference_map = {},
+  const Time_Transform &track_map = {}
+)
+{
+  Token_Index reference_index, track_index;
+  {
+    Trace_Scope trace("index tokens");
+    reference_index = build_token_index(reference);
+    track_index = build_token_index(track);
+  }
+  std::vector<Anchor> anchors;
+  {
+    Trace_Scope trace("match anchors");
+    anchors = match_anchors(
+      reference,
+      reference_index,
+      reference_map,
+      track,
+      track_index,
+      track_map
+    );
+  }
+  Trace_Scope trace("estimate time map");
+  result = estimate_time_map(anchors);
+  return result.inliers >= 3;
+}
+// }}}
+
+// Audio sync {{{
+// Syncs tracks to the speech in a 16-bit PCM WAV file. The file is read in
+// chunks into the energy of every 10 ms frame; frames louder than halfway
+// between the quiet and the loud end of the file count as voice. The shift of
+// a track is the one at which its cues best coincide with the voice, found
+// for all shifts at once by cross-correlation through the FFT.
+
+constexpr double audio_frame_seconds = 0.01;
+constexpr double audio_max_shift = 60.0;  // seconds.
+
+// Appends the mean energy of every frame of the WAV file to `energy`,
+// reading a chunk of samples at a time. Samples are taken to be
+// little-endian, as on the hosts this runs on.
+bool read_frame_energy(const std::string &filename, std::vector<float> &energy)
+{
+  std::ifstream in(filename, std::ios::binary);
+  if (!in) {
+    Log(Log_Level::error) << "Cannot open " << filename << ".\n";
+    return false;
+  }
+  auto fail = [&](const char *what) {
+    Log(Log_Level::error) << filename << ": " << what << "\n";
+    return false;
+  };
+  auto u16 = [](const char *p) {
+    return unsigned(uint8_t(p[0])) | unsigned(uint8_t(p[1])) << 8;
+  };
+  auto u32 = [&](const char *p) { return uint32_t(u16(p) | u16(p + 2) << 16); };
+  char riff[12];
+  if (!in.read(riff, sizeof(riff)) || std::memcmp(riff, "RIFF", 4) != 0
+      || std::memcmp(riff + 8, "WAVE", 4) != 0) {
+    return fail("not a WAV file.");
+  }
+  unsigned channels = 0, rate = 0;
+  uint64_t data_size;
+  for (;;) {
+    char header[8];
+    if (!in.read(header, sizeof(header))) {
+      return fail("no audio data.");
+    }
+    uint32_t size = u32(header + 4);
+    if (std::memcmp(header, "data", 4) == 0) {
+      data_size = size;
+      break;
+    }
+    uint32_t skip = size + (size & 1);
+    if (std::memcmp(header, "fmt ", 4) == 0) {
+      char fmt[40] = {};
+      uint32_t len = std::min<uint32_t>(size, sizeof(fmt));
+      if (size < 16 || !in.read(fmt, len)) {
+        return fail("bad format chunk.");
+      }
+      skip -= len;
+      unsigned tag = u16(fmt);
+      if (tag == 0xfffe && size >= 26) {
+        tag = u16(fmt + 24);  // WAVE_FORMAT_EXTENSIBLE sub-format.
+      }
+      if (tag != 1 || u16(fmt + 14) != 16) {
+        return fail("only 16-bit PCM audio is supported.");
+      }
+      channels = u16(fmt + 2);
+      rate = u32(fmt + 4);
+    }
+    in.ignore(skip);
+  }
+  if (channels == 0 || rate < 1 / audio_frame_seconds) {
+    return fail("no usable format chunk before the audio data.");
+  }
+  // Written to a pipe, ffmpeg leaves the size at 0 or 0xffffffff.
+  if (data_size == 0 || data_size == 0xffffffff) {
+    data_size = std::numeric_limits<uint64_t>::max();
+  }
+  const size_t frame_samples =
+    channels * (size_t)std::lround(rate * audio_frame_seconds);
+  std::vector<int16_t> buf(1 << 16);
+  int64_t sum = 0;
+  size_t in_frame = 0;
+  while (data_size >= 2) {
+    size_t want = std::min<uint64_t>(buf.size(), data_size / 2);
+    in.read(reinterpret_cast<char *>(buf.data()), want * 2);
+    size_t n = in.gcount() / 2;
+    if (n == 0) {
+      break;
+    }
+    data_size -= n * 2;
+    g_metrics.bytes_read += n * 2;
+    for (size_t i = 0; i < n;) {
+      size_t m = std::min(n - i, frame_samples - in_frame);
+      // A plain sum of squares, which the compiler vectorizes.
+      const int16_t *samples = buf.data() + i;
+      int64_t part = 0;
+      for (size_t j = 0; j < m; ++j) {
+        part += int32_t(samples[j]) * samples[j];
+      }
+      sum += part;
+      i += m;
+      in_frame += m;
+      if (in_frame == frame_samples) {
+        energy.push_back(float(sum) / frame_samples);
+        sum = 0;
+        in_frame = 0;
+      }
+    }
+  }
+  return true;
+}
+
+// +1 for the frames louder than halfway, in dB, between the 10th and the
+// 90th percentile of `energy`, and -1 for the others.
+std::vector<float> voice_activity(const std::vector<float> &energy)
+{
+  std::vector<float> voice(energy.size());
+  for (size_t i = 0; i < energy.size(); ++i) {
+    voice[i] = 10.0f * std::log10(energy[i] + 1.0f);
+  }
+  std::vector<float> levels = voice;
+  auto percentile = [&](double p) {
+    auto it = levels.begin() + (size_t)(p * (levels.size() - 1));
+    std::nth_element(levels.begin(), it, levels.end());
+    return *it;
+  };
+  const float threshold = (percentile(0.1) + percentile(0.9)) / 2;
+  for (float &v : voice) {
+    v = v > threshold ? 1.0f : -1.0f;
+  }
+  return voice;
+}
+
+using Complex = std::complex<double>;
+
+// In-place radix-2 FFT of a power-of-two size, unscaled both ways. Products
+// are spelled out, as std::complex's checks for infinities are slow.
+void fft(std::vector<Complex> &a, bool inverse)
+{
+  const size_t n = a.size();
+  for (size_t i = 1, j = 0; i < n; ++i) {
+    size_t bit = n >> 1;
+    for (; j & bit; bit >>= 1) {
+      j ^= bit;
+    }
+    j ^= bit;
+    if (i < j) {
+      std::swap(a[i], a[j]);
+    }
+  }
+  std::vector<Complex> roots(n / 2);
+  for (size_t k = 0; k < n / 2; ++k) {
+    double angle = (inverse ? 2.0 : -2.0) * M_PI * k / n;
+    roots[k] = {std::cos(angle), std::sin(angle)};
+  }
+  for (size_t len = 2; len <= n; len <<= 1) {
+    const size_t half = len / 2, step = n / len;
+    for (size_t i = 0; i < n; i += len) {
+      for (size_t k = 0; k < half; ++k) {
+        const Complex w = roots[k * step];
+        const Complex x = a[i + k + half];
+        const Complex v(
+          x.real() * w.real() - x.imag() * w.imag(),
+          x.real() * w.imag() + x.imag() * w.real()
+        );
+        a[i + k + half] = a[i + k] - v;
+        a[i + k] += v;
+      }
+    }
+  }
+}
+
+// The spectrum of the voice activity, padded so that shifts of up to
+// max_lag frames don't wrap around. Computed once for all the tracks.
+struct Voice_Spectrum {
+  size_t frames;
+  size_t max_lag;
+  std::vector<Complex> bins;
+};
+
+Voice_Spectrum voice_spectrum(const std::vector<float> &voice)
+{
+  Voice_Spectrum spectrum;
+  spectrum.frames = voice.size();
+  spectrum.max_lag = std::lround(audio_max_shift / audio_frame_seconds);
+  size_t n = 1;
+  while (n < spectrum.frames + 2 * spectrum.max_lag) {
+    n <<= 1;
+  }
+  spectrum.bins.assign(n, 0.0);
+  std::copy(voice.begin(), voice.end(), spectrum.bins.begin());
+  fft(spectrum.bins, false);
+  return spectrum;
+}
+
+struct Audio_Sync_Result {
+  double shift = 0.0;
+  // How far the best correlation stands out from the best one over 1 s away,
+  // relative to the median one: from 0 to 1.
+  double confidence = 0.0;
+};
+
+// Finds the shift that best lines up the cues of `srt`, +1 while one is shown
+// and -1 otherwise, with the voice activity.
+Audio_Sync_Result audio_sync(const Voice_Spectrum &voice, const SRT_File &srt)
+{
+  const size_t n = voice.bins.size();
+  const long lag = voice.max_lag;
+  // Later cues can't be shifted onto the audio.
+  const size_t frames = voice.frames + lag;
+  std::vector<Complex> bins(n, 0.0);
+  std::fill(bins.begin(), bins.begin() + frames, -1.0);
+  for (const SRT_Subtitle &sub : srt.subtitles) {
+    long from = std::lround(sub.start / audio_frame_seconds);
+    long to = std::lround(sub.stop / audio_frame_seconds);
+    from = std::clamp<long>(from, 0, frames);
+    to = std::clamp<long>(to, from, frames);
+    std::fill(bins.begin() + from, bins.begin() + to, 1.0);
+  }
+  fft(bins, false);
+  for (size_t i = 0; i < n; ++i) {
+    const Complex a = voice.bins[i], b = bins[i];
+    bins[i] = {
+      a.real() * b.real() + a.imag() * b.imag(),
+      a.imag() * b.real() - a.real() * b.imag()
+    };
+  }
+  fft(bins, true);
+  // The correlation at shift k frames is in bins[k mod n].
+  auto correlation = [&](long k) { return bins[(k + n) % n].real(); };
+  long best = 0;
+  for (long k = -lag; k <= lag; ++k) {
+    double c = correlation(k), b = correlation(best);
+    if (c > b || (c == b && std::abs(k) < std::abs(best))) {
+      best = k;
+    }
+  }
+  const long apart = std::lround(1.0 / audio_frame_seconds);
+  double second = -std::numeric_limits<double>::infinity();
+  std::vector<double> all;
+  for (long k = -lag; k <= lag; ++k) {
+    all.push_back(correlation(k));
+    if (std::abs(k - best) > apart) {
+      second = std::max(second, correlation(k));
+    }
+  }
+  std::nth_element(all.begin(), all.begin() + all.size() / 2, all.end());
+  const double median = all[all.size() / 2];
+  Audio_Sync_Result result;
+  result.shift = best * audio_frame_seconds;
+  if (correlation(best) > median) {
+    result.confidence = std::clamp(
+      (correlation(best) - second) / (correlation(best) - median), 0.0, 1.0
+    );
+  }
+  return result;
+}
+// }}}
+
+// Standard output, for writing the result to "-". In that case std::cout
+// itself is redirected to stderr, to keep progress messages out of it.
+std::streambuf *g_stdout_buf = std::cout.rdbuf();
+
+// Opens `filename` for writing, with "-" meaning standard output.
+std::unique_ptr<std::ostream> open_output(const std::string &filename)
+{
+  if (filename == "-") {
+    return std::make_unique<std::ostream>(g_stdout_buf);
+  }
+  return std::make_unique<std::ofstream>(filename, std::ios::binary);
+}
+
+// Streaming mode {{{
+enum class Read_Result { cue, waiting, end };
+
+// Pulls cues one at a time out of a file descriptor, holding only the
+// unparsed tail of the input in memory.
+struct SRT_Stream_Reader {
+  static constexpr size_t chunk_size = 64 * 1024;
+
+  int fd;
+  std::ostream *flush_before_read;  // flushed before blocking on input.
+  bool follow = false;  // reaching the end of the file means: wait for more.
+  std::string buf;
+  size_t pos = 0;
+  bool at_start = true;
+  bool at_eof = false;
+
+  // Parses the next complete cue. `waiting` is returned when the input has
+  // no more data for now: at the end of a followed file, or when a
+  // non-blocking descriptor would block.
+  Read_Result read_cue(SRT_Subtitle &sub)
+  {
+    while (true) {
+      const char *p = buf.data() + pos;
+      Cue_Result result =
+        parse_srt_cue(p, buf.data() + buf.size(), at_eof, sub);
+      switch (result) {
+        case Cue_Result::ok: pos = p - buf.data(); return Read_Result::cue;
+        case Cue_Result::end: pos = p - buf.data(); return Read_Result::end;
+        case Cue_Result::malformed: pos = p - buf.data(); continue;
+        case Cue_Result::incomplete: break;
+      }
+      buf.erase(0, pos);
+      pos = 0;
+      ssize_t len = fill();
+      if (len > 0) {
+        continue;
+      }
+      if ((len == 0 && follow) || (len < 0 && errno == EAGAIN)) {
+        return Read_Result::waiting;
+      }
+      at_eof = true;
+    }
+  }
+
+  // Returns false once the input is exhausted.
+  bool next(SRT_Subtitle &sub) { return read_cue(sub) == Read_Result::cue; }
+
+  // Appends whatever input is available, blocking until there is some
+  // unless the descriptor is non-blocking. Returns the result of read().
+  ssize_t fill()
+  {
+    if (flush_before_read) {
+      flush_before_read->flush();
+    }
+    size_t old_size = buf.size();
+    buf.resize(old_size + chunk_size);
+    ssize_t len;
+    do {
+      len = read(fd, buf.data() + old_size, chunk_size);
+    } while (len < 0 && errno == EINTR);
+    int read_errno = errno;
+    buf.resize(old_size + std::max<ssize_t>(len, 0));
+    if (len < 0 && read_errno != EAGAIN) {
+      perror("read");
+    }
+    g_metrics.bytes_read += std::max<ssize_t>(len, 0);
+    if (at_start && (buf.size() >= 3 || (len == 0 && !follow))) {
+      if (buf.compare(0, 3, "\xef\xbb\xbf") == 0) {
+        buf.erase(0, 3);  // UTF-8 byte order mark.
+      }
+      at_start = false;
+    }
+    errno = read_errno;
+    return len;
+  }
+};
+
+// Owns the descriptor of its reader, unless that is stdin, and its converter,
+// so that they are closed however the stream job ends.
+struct Stream_Track {
+  SRT_Stream_Reader reader;
+  iconv_t cvt = (iconv_t)-1;  // (iconv_t)-1 if no conversion is needed.
+  double shift;
+  size_t pending = 0;
+  bool done = false;
+
+  Stream_Track(int fd, std::ostream *out, double shift) :
+    reader{fd, out}, shift(shift)
+  {
+  }
+  Stream_Track(Stream_Track &&other) noexcept :
+    reader(std::move(other.reader)),
+    cvt(other.cvt),
+    shift(other.shift),
+    pending(other.pending),
+    done(other.done)
+  {
+    other.reader.fd = -1;
+    other.cvt = (iconv_t)-1;
+  }
+  Stream_Track &operator=(Stream_Track &&) = delete;
+  ~Stream_Track()
+  {
+    if (reader.fd > 0) {
+      close(reader.fd);
+    }
+    if (cvt != (iconv_t)-1) {
+      iconv_close(cvt);
+    }
+  }
+};
+
+// Merges the tracks into `out` while they are being read. Track i gets style
+// i. Events are placed by `resolver`, if given. Each track must be sorted by
+// start time, up to a local disorder of `window` cues; that many cues per
+// track are held back before emitting the earliest one. Returns the number of
+// events emitted out of order because the disorder exceeded the window.
+size_t stream_merge(
+  std::vector<Stream_Track> &tracks,
+  const std::vector<ASS_Style> &styles,
+  Collision_Resolver *resolver,
+  const Output_Format &format,
+  std::ostream &out,
+  size_t window
+)
+{
+  format.write_header(out, styles);
+  auto later = [](const ASS_Subtitle &l, const ASS_Subtitle &r) {
+    return l.start > r.start;
+  };
+  std::vector<ASS_Subtitle> heap;
+  heap.reserve(window * tracks.size());
+  SRT_Subtitle sub;
+  std::string line;
+  Time last_start = -std::numeric_limits<Time>::infinity();
+  size_t out_of_order = 0;
+  size_t emitted = 0;
+  while (true) {
+    for (size_t i = 0; i < tracks.size(); ++i) {
+      Stream_Track &track = tracks[i];
+      while (!track.done && track.pending < window) {
+        if (!track.reader.next(sub)) {
+          track.done = true;
+          break;
+        }
+        if (track.cvt != (iconv_t)-1) {
+          convert_text(track.cvt, sub.text);
+        }
+        heap.push_back(
+          {(int)i,
+           sub.start + track.shift,
+           sub.stop + track.shift,
+           std::move(sub.text)}
+        );
+        std::push_heap(heap.begin(), heap.end(), later);
+        track.pending++;
+        g_metrics.cues_parsed++;
+      }
+    }
+    if (heap.empty()) {
+      break;
+    }
+    std::pop_heap(heap.begin(), heap.end(), later);
+    ASS_Subtitle &event = heap.back();
+    out_of_order += event.start < last_start;
+    last_start = event.start;
+    if (resolver) {
+      resolver->place(event);
+    }
+    line.clear();
+    format.append_event(line, event, styles, ++emitted);
+    out << line;
+    tracks[event.style].pending--;
+    heap.pop_back();
+  }
+  out << format.footer;
+  out.flush();
+  return out_of_order;
+}
+// }}}
+
+// Live tail mode {{{
+volatile sig_atomic_t g_stop_requested = 0;
+
+// End-to-end latency from reading the last byte of a cue to flushing its
+// event, in 1 ms buckets so that it needs constant memory however long the
+// session runs.
+struct Latency_Histogram {
+  std::vector<size_t> buckets = std::vector<size_t>(10001, 0);
+  size_t count = 0;
+  double sum_ms = 0.0;
+  double max_ms = 0.0;
+
+  void add(double ms)
+  {
+    buckets[std::min<size_t>((size_t)ms, buckets.size() - 1)]++;
+    count++;
+    sum_ms += ms;
+    max_ms = std::max(max_ms, ms);
+  }
+
+  // Upper bound of the bucket holding the p-th fraction of the samples.
+  double percentile(double p) const
+  {
+    size_t rank = (size_t)std::ceil(p * count);
+    size_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); ++i) {
+      seen += buckets[i];
+      if (seen >= rank && seen > 0) {
+        return std::min<double>(i + 1, max_ms);
+      }
+    }
+    return max_ms;
+  }
+};
+
+struct Follow_Event {
+  ASS_Subtitle event;
+  std::chrono::steady_clock::time_point arrival;
+};
+
+// Like stream_merge(), but keeps following the tracks as they grow. An event
+// is emitted once every live track has `window` cues pending, or at the
+// latest max_latency after its cue was read, so a track that stalls delays
+// the other one by a bounded amount (at the cost of an event that arrives
+// later being appended out of order). Runs until all tracks are closed (for
+// pipes) or until SIGINT/SIGTERM.
+void follow_merge(
+  std::vector<Stream_Track> &tracks,
+  const std::vector<ASS_Style> &styles,
+  Collision_Resolver *resolver,
+  const Output_Format &format,
+  std::ostream &out,
+  size_t window,
+  std::chrono::milliseconds max_latency,
+  Latency_Histogram &latency
+)
+{
+  using Clock = std::chrono::steady_clock;
+
+  // Pipes are made non-blocking below. Their open file description may be
+  // shared with other processes (stdin with the shell, for a terminal), so
+  // the original flags are put back however this returns.
+  struct Saved_Flags {
+    std::vector<std::pair<int, int>> flags;  // (fd, flags).
+
+    ~Saved_Flags()
+    {
+      for (const auto &[fd, flags] : flags) {
+        fcntl(fd, F_SETFL, flags);
+      }
+    }
+  } saved_flags;
+
+  // Regular files never poll as "not readable", so wait for them to grow
+  // through inotify. Pipes are polled directly.
+  int inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+  std::vector<pollfd> pfds = {{inotify_fd, POLLIN, 0}};
+  std::vector<size_t> track_pfd(tracks.size(), 0);
+  for (size_t i = 0; i < tracks.size(); ++i) {
+    Stream_Track &track = tracks[i];
+    struct stat st;
+    fstat(track.reader.fd, &st);
+    if (S_ISREG(st.st_mode)) {
+      track.reader.follow = true;
+      std::string path = "/proc/self/fd/" + std::to_string(track.reader.fd);
+      inotify_add_watch(inotify_fd, path.c_str(), IN_MODIFY);
+    } else {
+      int flags = fcntl(track.reader.fd, F_GETFL);
+      if (flags >= 0) {
+        saved_flags.flags.push_back({track.reader.fd, flags});
+        fcntl(track.reader.fd, F_SETFL, flags | O_NONBLOCK);
+      }
+      track_pfd[i] = pfds.size();
+      pfds.push_back({track.reader.fd, POLLIN, 0});
+    }
+    track.reader.flush_before_read = nullptr;
+  }
+
+  // Only let SIGINT/SIGTERM in while waiting, so that a stop request can't
+  // slip in between checking g_stop_requested and going to sleep.
+  sigset_t blocked, wait_mask;
+  sigemptyset(&blocked);
+  sigaddset(&blocked, SIGINT);
+  sigaddset(&blocked, SIGTERM);
+  sigprocmask(SIG_BLOCK, &blocked, &wait_mask);
+
+  format.write_header(out, styles);
+  out.flush();
+
+  auto later = [](const Follow_Event &l, const Follow_Event &r) {
+    return l.event.start > r.event.start;
+  };
+  std::vector<Follow_Event> heap;
+  std::vector<Clock::time_point> emitted;
+  size_t number = 0;
+  SRT_Subtitle sub;
+  std::string line;
+  while (true) {
+    bool stop = g_stop_requested;
+
+    // Take in every cue that has been completed by now.
+    bool all_done = true;
+    for (size_t i = 0; i < tracks.size(); ++i) {
+      Stream_Track &track = tracks[i];
+      while (!track.done) {
+        Read_Result result = track.reader.read_cue(sub);
+        if (result == Read_Result::waiting) {
+          break;
+        }
+        if (result == Read_Result::end) {
+          track.done = true;
+          if (track_pfd[i]) {
+            pfds[track_pfd[i]].fd = -1;  // a closed pipe polls as ready.
+          }
+          break;
+        }
+        if (track.cvt != (iconv_t)-1) {
+          convert_text(track.cvt, sub.text);
+        }
+        heap.push_back(
+          {{(int)i,
+            sub.start + track.shift,
+            sub.stop + track.shift,
+            std::move(sub.text)},
+           Clock::now()}
+        );
+        std::push_heap(heap.begin(), heap.end(), later);
+        track.pending++;
+        g_metrics.cues_parsed++;
+      }
+      all_done &= track.done;
+    }
+
+    // Emit what is final.
+    Clock::time_point now = Clock::now();
+    Clock::time_point oldest = Clock::time_point::max();
+    while (!heap.empty()) {
+      bool final = stop || all_done;
+      if (!final) {
+        final = true;
+        for (const Stream_Track &track : tracks) {
+          final &= track.done || track.pending >= window;
+        }
+      }
+      oldest = Clock::time_point::max();
+      for (const Follow_Event &e : heap) {
+        oldest = std::min(oldest, e.arrival);
+      }
+      if (!final && now - oldest < max_latency) {
+        break;
+      }
+      std::pop_heap(heap.begin(), heap.end(), later);
+      if (resolver) {
+        resolver->place(heap.back().event);
+      }
+      line.clear();
+      format.append_event(line, heap.back().event, styles, ++number);
+      out << line;
+      emitted.push_back(heap.back().arrival);
+      tracks[heap.back().event.style].pending--;
+      heap.pop_back();
+    }
+    if (!emitted.empty()) {
+      out.flush();
+      Clock::time_point flushed = Clock::now();
+      for (Clock::time_point arrival : emitted) {
+        latency.add(
+          std::chrono::duration<double, std::milli>(flushed - arrival).count()
+        );
+      }
+      emitted.clear();
+    }
+    if (heap.empty() && (all_done || stop)) {
+      break;
+    }
+
+    // Wait for more input, or until the oldest pending event is due.
+    timespec timeout;
+    timespec *timeout_ptr = nullptr;
+    if (!heap.empty()) {
+      auto due = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        oldest + max_latency - Clock::now()
+      );
+      due = std::max(due, std::chrono::nanoseconds(0));
+      timeout.tv_sec = due.count() / 1000000000;
+      timeout.tv_nsec = due.count() % 1000000000;
+      timeout_ptr = &timeout;
+    }
+    if (ppoll(pfds.data(), pfds.size(), timeout_ptr, &wait_mask) > 0
+        && (pfds[0].revents & POLLIN)) {
+      char buf[4096];
+      while (read(inotify_fd, buf, sizeof(buf)) > 0) {
+      }
+    }
+    // ppoll() only delivers signals when it gets interrupted, not when input
+    // was ready already.
+    sigset_t pending;
+    sigpending(&pending);
+    if (sigismember(&pending, SIGINT) || sigismember(&pending, SIGTERM)) {
+      g_stop_requested = 1;
+    }
+  }
+  out << format.footer;
+  out.flush();
+  sigprocmask(SIG_SETMASK, &wait_mask, nullptr);
+  close(inotify_fd);
+}
+// }}}
+
+// Watch mode {{{
+// An input SRT file kept in memory together with the byte offset of every
+// cue, so that an edit only requires re-parsing the cues it touched. The
+// cues in `srt` are encoding-converted and mapped through `map` already.
+struct Watched_Track {
+  std::string path;
+  const Input_Format *format;
+  double fps;
+  std::string encoding;
+  std::string content;
+  std::vector<size_t> offsets;
+  SRT_File *srt;
+  Time_Transform map;
+  int wd;
+};
+
+// Re-parses the cues of `track` that overlap with the bytes in which
+// new_content differs from the current content, and splices them into
+// track.srt. Returns the number of re-parsed cues.
+size_t reparse_changed_range(
+  Watched_Track &track,
+  std::string new_content,
+  const std::string &o_enc
+)
+{
+  const std::string &old = track.content;
+  size_t limit = std::min(old.size(), new_content.size());
+  size_t prefix =
+    std::mismatch(old.begin(), old.begin() + limit, new_content.begin())
+      .first
+    - old.begin();
+  size_t suffix =
+    std::mismatch(
+      old.rbegin(), old.rbegin() + (limit - prefix), new_content.rbegin()
+    )
+      .first
+    - old.rbegin();
+  if (prefix == old.size() && prefix == new_content.size()) {
+    return 0;
+  }
+
+  std::vector<size_t> &offsets = track.offsets;
+  std::vector<SRT_Subtitle> &subs = track.srt->subtitles;
+  if (track.format != g_srt_format) {
+    // Cue offsets are only kept for SRT; other formats are re-parsed whole.
+    SRT_File fresh = parse_subtitles(
+      new_content, *track.format, track.fps, nullptr, track.map
+    );
+    if (track.encoding != o_enc) {
+      convert_encoding(fresh, track.encoding.c_str(), o_enc.c_str());
+    }
+    subs = std::move(fresh.subtitles);
+    track.content = std::move(new_content);
+    return subs.size();
+  }
+
+  // First affected cue: the last one starting at or before the first changed
+  // byte. First unaffected cue: the first one whose number line and the
+  // blank line in front of it (4 bytes covers CRLF) lie in the unchanged
+  // suffix.
+  size_t i0 = std::upper_bound(offsets.begin(), offsets.end(), prefix)
+              - offsets.begin();
+  i0 = i0 > 0 ? i0 - 1 : 0;
+  size_t j0 = std::lower_bound(
+                offsets.begin() + i0, offsets.end(), old.size() - suffix + 4
+              )
+              - offsets.begin();
+  std::ptrdiff_t delta = (std::ptrdiff_t)new_content.size() - old.size();
+
+  size_t begin = i0 == 0 ? 0 : offsets[i0];
+  size_t end = j0 < offsets.size() ? offsets[j0] + delta : new_content.size();
+  SRT_File fresh;
+  std::vector<size_t> fresh_offsets;
+  parse_srt_range(
+    new_content, begin, end, fresh.subtitles, &fresh_offsets, track.map
+  );
+  if (track.encoding != o_enc) {
+    convert_encoding(fresh, track.encoding.c_str(), o_enc.c_str());
+  }
+
+  for (size_t j = j0; j < offsets.size(); ++j) {
+    offsets[j] += delta;
+  }
+  subs.erase(subs.begin() + i0, subs.begin() + j0);
+  subs.insert(
+    subs.begin() + i0,
+    std::make_move_iterator(fresh.subtitles.begin()),
+    std::make_move_iterator(fresh.subtitles.end())
+  );
+  offsets.erase(offsets.begin() + i0, offsets.begin() + j0);
+  offsets.insert(
+    offsets.begin() + i0, fresh_offsets.begin(), fresh_offsets.end()
+  );
+  track.content = std::move(new_content);
+  return fresh.subtitles.size();
+}
+
+void merge_and_write(
+  const std::vector<const SRT_File *> &tracks,
+  const std::vector<ASS_Style> &styles,
+  bool pair_cues,
+  bool place_events,
+  const std::vector<Output> &outputs
+)
+{
+  ASS_File ass;
+  ass.styles = styles;
+
+  // The outputs are opened and get their headers while the merge runs.
+  std::vector<std::unique_ptr<std::ostream>> streams(outputs.size());
+  std::thread header_writer = traced_thread([&] {
+    Scoped_Timer timer("write headers");
+    for (size_t i = 0; i < outputs.size(); ++i) {
+      streams[i] = open_output(outputs[i].filename);
+      outputs[i].format->write_header(*streams[i], styles);
+    }
+  });
+  {
+    Scoped_Timer timer("merge");
+    if (pair_cues) {
+      pair_tracks(ass, *tracks[0], *tracks[1]);
+    } else {
+      merge_tracks(ass, tracks);
+    }
+  }
+  if (place_events) {
+    Scoped_Timer timer("resolve collisions");
+    resolve_collisions(ass);
+  }
+  header_writer.join();
+  for (size_t i = 0; i < outputs.size(); ++i) {
+    Scoped_Timer timer("write");
+    write_events(*streams[i], *outputs[i].format, ass);
+  }
+}
+
+// Watches the directories of the tracks for files being written or renamed
+// into place (as editors do on save), and re-merges whenever one of the
+// tracks changed. Only returns on error.
+int watch_and_remerge(
+  std::vector<Watched_Track> &tracks,
+  const std::vector<const SRT_File *> &merged,
+  const std::vector<ASS_Style> &styles,
+  bool pair_cues,
+  bool place_events,
+  const std::string &o_enc,
+  const std::vector<Output> &outputs
+)
+{
+  int fd = inotify_init1(IN_CLOEXEC);
+  if (fd < 0) {
+    perror("inotify_init1");
+    return 1;
+  }
+  for (Watched_Track &track : tracks) {
+    std::string dir = std::filesystem::path(track.path).parent_path();
+    track.wd = inotify_add_watch(
+      fd, dir.empty() ? "." : dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO
+    );
+    if (track.wd < 0) {
+      perror("inotify_add_watch");
+      return 1;
+    }
+  }
+  Log(Log_Level::info) << "Watching for changes... (Ctrl-C to stop)\n";
+
+  alignas(inotify_event) char buf[16 * 1024];
+  while (true) {
+    ssize_t len = read(fd, buf, sizeof(buf));
+    if (len <= 0) {
+      perror("read");
+      return 1;
+    }
+    std::vector<bool> changed(tracks.size(), false);
+    for (char *p = buf; p < buf + len;) {
+      const inotify_event *ev = (const inotify_event *)p;
+      for (size_t i = 0; i < tracks.size(); ++i) {
+        std::string name = std::filesystem::path(tracks[i].path).filename();
+        if (ev->wd == tracks[i].wd && ev->len && name == ev->name) {
+          changed[i] = true;
+        }
+      }
+      p += sizeof(inotify_event) + ev->len;
+    }
+
+    g_metrics.stages.clear();  // only the initial run is reported.
+    auto t0 = std::chrono::steady_clock::now();
+    size_t reparsed = 0;
+    bool any = false;
+    for (size_t i = 0; i < tracks.size(); ++i) {
+      std::string content;
+      if (!changed[i] || !read_file(tracks[i].path, content)) {
+        continue;
+      }
+      Scoped_Timer timer("reparse");
+      try {
+        reparsed +=
+          reparse_changed_range(tracks[i], std::move(content), o_enc);
+      } catch (std::exception &err) {
+        // Likely saved half way through an edit; keep the previous version.
+        Log(Log_Level::error) << tracks[i].path << ": " << err.what()
+                              << " Waiting for the next change.\n";
+        continue;
+      }
+      any = true;
+    }
+    if (!any) {
+      continue;
+    }
+    merge_and_write(merged, styles, pair_cues, place_events, outputs);
+    std::chrono::duration<double, std::milli> dt =
+      std::chrono::steady_clock::now() - t0;
+    log_printf(
+      Log_Level::info,
+      "Re-merged in %.2f ms (%zu cues re-parsed).\n",
+      dt.count(),
+      reparsed
+    );
+  }
+}
+// }}}
+
+// Tracks {{{
+enum class Sync_Method { timing, anchors };
+
+struct Track_Options {
+  std::string label;  // for messages.
+  std::string filename;
+  std::string encoding = "UTF-8";
+  double shift = 0.0;
+  int sync_reference = -1;  // index of the track to auto-sync to, or -1.
+  ASS_Style style;
+  const Input_Format *format = nullptr;  // sniffed if not given.
+  double fps = 0.0;                      // for MicroDVD; 0 if not given.
+  Sync_Method sync_method = Sync_Method::timing;
+};
+
+// Default style of the index-th track: the built-in ones first, then copies
+// of Top stacked below it.
+ASS_Style default_track_style(size_t index)
+{
+  if (index < std::size(g_builtin_styles)) {
+    return g_builtin_styles[index];
+  }
+  ASS_Style style = g_builtin_styles[1];
+  style.name = "Track" + std::to_string(index);
+  style.margin_v = 10 + 30 * (int)(index - 2);
+  return style;
+}
+
+// Parses a --track spec, "FILE[,KEY=VALUE]...". The options are applied in
+// order, so style= should come before align=, margin= and color=.
+bool parse_track_spec(
+  const std::string &spec,
+  size_t index,
+  Track_Options &track
+)
+{
+  size_t comma = spec.find(',');
+  track.filename = spec.substr(0, comma);
+  track.style = default_track_style(index);
+  if (track.filename.empty()) {
+    Log(Log_Level::error) << "Missing file name in track \"" << spec << "\".\n";
+    return false;
+  }
+  while (comma != std::string::npos) {
+    size_t next = spec.find(',', comma + 1);
+    std::string item = spec.substr(comma + 1, next - comma - 1);
+    comma = next;
+    size_t eq = item.find('=');
+    std::string key = item.substr(0, eq);
+    std::string value = eq == std::string::npos ? "" : item.substr(eq + 1);
+    try {
+      if (key == "enc") {
+        track.encoding = value;
+      } else if (key == "shift") {
+        track.shift = std::stod(value);
+      } else if (key == "style") {
+        for (const ASS_Style &style : g_builtin_styles) {
+          if (style.name == value) {
+            track.style = style;
+          }
+        }
+        track.style.name = value;
+      } else if (key == "align") {
+        track.style.alignment = std::stoi(value);
+      } else if (key == "margin") {
+        track.style.margin_v = std::stoi(value);
+      } else if (key == "color") {
+        track.style.primary_colour = value;
+      } else if (key == "sync") {
+        track.sync_reference = std::stoi(value);
+      } else if (key == "method") {
+        if (value != "timing" && value != "anchors") {
+          Log(Log_Level::error) << "Unknown sync method \"" << value << "\".\n";
+          return false;
+        }
+        track.sync_method =
+          value == "anchors" ? Sync_Method::anchors : Sync_Method::timing;
+      } else if (key == "format") {
+        track.format = find_input_format(value);
+        if (!track.format) {
+          Log(Log_Level::error)
+            << "Unknown input format \"" << value << "\".\n";
+          return false;
+        }
+      } else if (key == "fps") {
+        track.fps = std::stod(value);
+      } else {
+        Log(Log_Level::error) << "Unknown track option \"" << item << "\".\n";
+        return false;
+      }
+    } catch (std::exception &) {
+      Log(Log_Level::error)
+        << "Invalid value in track option \"" << item << "\".\n";
+      return false;
+    }
+    if (value.empty()) {
+      Log(Log_Level::error)
+        << "Missing value in track option \"" << item << "\".\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+// Checks that the sync references and style names of the tracks are
+// consistent. Auto-synced tracks can't serve as a reference, so that all of
+// them can be synced at the same time.
+bool validate_tracks(const std::vector<Track_Options> &tracks)
+{
+  for (size_t i = 0; i < tracks.size(); ++i) {
+    int ref = tracks[i].sync_reference;
+    if (ref >= 0
+        && (ref >= (int)tracks.size() || ref == (int)i
+            || tracks[ref].sync_reference >= 0)) {
+      Log(Log_Level::error) << "The " << tracks[i].label
+                            << " can't be synced to track " << ref << ".\n";
+      return false;
+    }
+    for (size_t j = 0; j < i; ++j) {
+      if (tracks[j].style.name == tracks[i].style.name) {
+        Log(Log_Level::error) << "Style " << tracks[i].style.name
+                              << " is used by more than one track.\n";
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Open-addressing hash table from SRT cue number to position in the track,
+// with linear probing in a power-of-two table at most half full. Numbers
+// usually count from 1, but may have gaps and repeats; a repeated number
+// maps to its first cue.
+struct Cue_Number_Index {
+  struct Slot {
+    int number;
+    uint32_t position;  // `free` if unused.
+  };
+  static constexpr uint32_t free = UINT32_MAX;
+  std::vector<Slot> slots;
+  int bits = 0;
+  size_t repeats = 0;
+
+  size_t home(int number) const
+  {
+    return bits == 0
+      ? 0
+      : (uint32_t)number * 0x9e3779b97f4a7c15ull >> (64 - bits);
+  }
+
+  void insert(int number, uint32_t position)
+  {
+    size_t mask = slots.size() - 1;
+    for (size_t i = home(number);; i = (i + 1) & mask) {
+      if (slots[i].position == free) {
+        slots[i] = {number, position};
+        return;
+      }
+      if (slots[i].number == number) {
+        repeats++;
+        return;
+      }
+    }
+  }
+
+  // The position of the cue numbered `number`, or -1.
+  long find(int number) const
+  {
+    size_t mask = slots.size() - 1;
+    for (size_t i = home(number); slots[i].position != free;
+         i = (i + 1) & mask) {
+      if (slots[i].number == number) {
+        return slots[i].position;
+      }
+    }
+    return -1;
+  }
+};
+
+Cue_Number_Index build_cue_number_index(const SRT_File &srt)
+{
+  Cue_Number_Index index;
+  while ((size_t(1) << index.bits) < 2 * srt.subtitles.size()) {
+    index.bits++;
+  }
+  index.slots.assign(size_t(1) << index.bits, {0, Cue_Number_Index::free});
+  for (size_t i = 0; i < srt.subtitles.size(); ++i) {
+    index.insert(srt.subtitles[i].num, i);
+  }
+  return index;
+}
+
+struct Input_Track {
+  Track_Options options;
+  SRT_File srt;
+  std::string content;  // kept for --watch, with the cue offsets.
+  std::vector<size_t> offsets;
+  Time_Transform map;  // total time transform applied to srt.
+  // Found by the syncs, which all work on the times it maps srt to, and
+  // applied to srt by apply_sync() once they are done.
+  Time_Transform sync;
+  Cue_Number_Index numbers;  // only for --sync-tb and --show-cue.
+};
+
+// Reads, parses and converts a track, shifting its times by options.shift
+// while parsing. Returns false if it can't be read or has no subtitles.
+bool load_track(
+  Input_Track &track,
+  const std::string &o_enc,
+  bool keep
+)
+{
+  const Track_Options &options = track.options;
+  Log(Log_Level::info) << "Reading " << options.label << " subtitle file...\n";
+  // Files are mapped rather than read, unless watch mode needs to keep a copy
+  // to compare the next version against.
+  std::string content;
+  Mapped_File mapped;
+  std::string_view buf;
+  {
+    Scoped_Timer timer("read");
+    if (!keep && mapped.map(options.filename)) {
+      buf = mapped.view();
+    } else if (read_file(options.filename, content)) {
+      buf = content;
+    } else {
+      Log(Log_Level::error) << "Cannot open " << options.filename << ".\n";
+      return false;
+    }
+  }
+  if (!track.options.format) {
+    track.options.format = &sniff_input_format(buf);
+  }
+  if (track.options.format != g_srt_format) {
+    Log(Log_Level::info) << "Parsing " << track.options.format->description
+                         << "...\n";
+  }
+  track.map = Time_Map{1.0, options.shift};
+  if (options.shift != 0.0) {
+    Log(Log_Level::info) << "Time shifting " << options.label
+                         << " subtitles by: " << options.shift
+                         << " seconds...\n";
+  }
+  try {
+    {
+      Scoped_Timer timer("parse");
+      track.srt = parse_subtitles(
+        buf,
+        *track.options.format,
+        track.options.fps,
+        keep ? &track.offsets : nullptr,
+        track.map
+      );
+    }
+    g_metrics.bytes_read += buf.size();
+    g_metrics.cues_parsed += track.srt.subtitles.size();
+    if (options.encoding != o_enc) {
+      Log(Log_Level::info) << "Converting " << options.label
+                           << " SRT encoding...\n";
+      Scoped_Timer timer("convert");
+      convert_encoding(track.srt, options.encoding.c_str(), o_enc.c_str());
+    }
+  } catch (std::exception &err) {
+    Log(Log_Level::error) << options.filename << ": " << err.what() << "\n";
+    return false;
+  }
+  if (track.srt.subtitles.empty()) {
+    Log(Log_Level::error) << "The " << options.label
+                          << " subtitle file does not contain any subtitles.\n";
+    return false;
+  }
+  Log(Log_Level::info) << "The " << options.label << " subtitle file contains "
+                       << track.srt.subtitles.size() << " subtitles.\n";
+  if (keep) {
+    track.content = std::move(content);
+  }
+  return true;
+}
 
-  std::string styles[2] = {"Bot", "Top"};
+// Below this confidence, a search around the shifts of earlier jobs is
+// redone over all of them.
+constexpr double prior_confidence = 0.5;
 
-  for (size_t i = 0; i < ass.subtitles.size(); ++i) {
-    const ASS_Subtitle &sub = ass.subtitles[i];
-    out << "Dialogue: 0,";
-    out << time_to_ass_str(sub.start) << "," << time_to_ass_str(sub.stop);
-    out << "," << styles[sub.style] << ",,0000,0000,0000,,";
-    out << text_to_ass_text(sub.text);
-    out << "\r\n";
+// Auto-syncs every track that has a sync reference to it, all of them in
+// parallel, and adds the map to the reference's time to its sync (see
+// Input_Track). Returns a report per
+// synced track, with the confidence if `measure_confidence` (which makes the
+// timing search slower).
+//
+// With `priors`, the shifts found for each track by earlier jobs of a
+// --batch group, timing sync first searches around those. The confidence is
+// then always measured, and the shifts found are added to them unless below
+// prior_confidence, so that a job whose offset is out of range doesn't lead
+// the later ones astray.
+std::vector<Sync_Report> sync_tracks(
+  std::vector<Input_Track> &tracks,
+  const Timing_Sync_Options &timing,
+  bool measure_confidence,
+  std::vector<std::vector<double>> *priors = nullptr
+)
+{
+  Scoped_Timer timer("auto-sync");
+  if (priors) {
+    priors->resize(tracks.size());
+  }
+  std::vector<Sync_Report> reports(tracks.size());
+  std::vector<std::string> logs(tracks.size());
+  std::vector<size_t> evaluations(tracks.size(), 0);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < tracks.size(); ++i) {
+    int ref = tracks[i].options.sync_reference;
+    if (ref < 0) {
+      continue;
+    }
+    threads.push_back(traced_thread([&, i, ref] {
+      t_log_buffer = &logs[i];
+      const SRT_File &reference = tracks[ref].srt;
+      const SRT_File &track = tracks[i].srt;
+      Sync_Report &report = reports[i];
+      if (tracks[i].options.sync_method == Sync_Method::anchors) {
+        Anchor_Sync_Result result;
+        bool found = anchor_sync(
+          reference, track, result, tracks[ref].sync, tracks[i].sync
+        );
+        log_printf(
+          Log_Level::verbose,
+          "  %zu anchors, %zu agree: offset %+.3f seconds, scale %.5f\n",
+          result.anchors,
+          result.inliers,
+          result.map.shift,
+          result.map.scale
+        );
+        if (found) {
+          report.method = "anchors";
+          report.map = result.map;
+          report.confidence = result.confidence;
+          return;
+        }
+        Log(Log_Level::info)
+          << "  Too few anchors agree; falling back to timing.\n";
+      }
+      const Start_Index reference_index =
+        build_start_index(reference, tracks[ref].sync);
+      const Start_Index track_index = build_start_index(track, tracks[i].sync);
+      if (priors && !(*priors)[i].empty()) {
+        Timing_Sync_Options options = timing;
+        options.priors = (*priors)[i];
+        Sync_Report guess;
+        double shift = find_best_shift(
+          reference_index, track_index, evaluations[i], options, &guess
+        );
+        double nearest = std::numeric_limits<double>::infinity();
+        for (double prior : options.priors) {
+          nearest = std::min(nearest, std::abs(shift - prior));
+        }
+        // At the edge of a window, the best shift may well lie beyond it.
+        if (guess.confidence >= prior_confidence
+            && nearest < options.prior_window - 0.01) {
+          report = std::move(guess);
+          report.method = "prior";
+          report.map.shift = shift;
+          return;
+        }
+        log_printf(
+          Log_Level::info,
+          "  Searching near earlier shifts gave %+.2f seconds, with "
+          "confidence %.2f; searching all shifts.\n",
+          shift,
+          guess.confidence
+        );
+      }
+      report.map.shift = find_best_shift(
+        reference_index,
+        track_index,
+        evaluations[i],
+        timing,
+        measure_confidence || priors ? &report : nullptr
+      );
+    }));
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  std::vector<Sync_Report> synced;
+  for (size_t i = 0; i < tracks.size(); ++i) {
+    int ref = tracks[i].options.sync_reference;
+    if (ref < 0) {
+      continue;
+    }
+    const Time_Map &map = reports[i].map;
+    Log(Log_Level::info) << "Auto syncing the " << tracks[i].options.label
+                         << " to the " << tracks[ref].options.label << "...\n";
+    log_write(logs[i]);
+    log_printf(Log_Level::info, "Best shift found: %.2f seconds\n", map.shift);
+    if (map.scale != 1.0) {
+      log_printf(Log_Level::info, "Time scale: %.6f\n", map.scale);
+    }
+    bool from_prior = std::string_view(reports[i].method) == "prior";
+    if (from_prior) {
+      log_printf(
+        Log_Level::info, "  (searched around the shifts of earlier jobs)\n"
+      );
+    }
+    if (measure_confidence || priors) {
+      log_printf(
+        Log_Level::info, "Confidence: %.2f\n", reports[i].confidence
+      );
+    }
+    if (priors && map.scale == 1.0
+        && reports[i].confidence >= prior_confidence) {
+      std::vector<double> &known = (*priors)[i];
+      if (std::none_of(known.begin(), known.end(), [&](double prior) {
+            return std::abs(prior - map.shift) < 0.1;
+          })) {
+        known.push_back(map.shift);
+      }
+    }
+    g_metrics.shifts_evaluated += evaluations[i];
+    tracks[i].sync = Time_Transform(map).after(tracks[i].sync);
+    reports[i].track = tracks[i].options.label;
+    reports[i].reference = tracks[ref].options.label;
+    synced.push_back(std::move(reports[i]));
   }
+  return synced;
 }
 
-struct SRT_Subtitle_Time_Comparator {
-  bool operator()(const SRT_Subtitle &sub, double time)
-  {
-    return sub.start < time;
+// Syncs the tracks that have no sync reference to the speech in a WAV file,
+// adding the shift to their sync and a report for each to `reports`. With
+// `top_follows_bottom` (--sync-tb), the top track is shifted along with the
+// bottom one instead.
+bool sync_to_audio(
+  const std::string &filename,
+  std::vector<Input_Track> &tracks,
+  bool top_follows_bottom,
+  std::vector<Sync_Report> &reports
+)
+{
+  Scoped_Timer timer("audio sync");
+  Log(Log_Level::info) << "Reading the audio of " << filename << "...\n";
+  std::vector<float> energy;
+  if (!read_frame_energy(filename, energy)) {
+    return false;
   }
-};
+  if (energy.empty()) {
+    Log(Log_Level::error) << filename << " contains no audio.\n";
+    return false;
+  }
+  const Voice_Spectrum voice = voice_spectrum(voice_activity(energy));
+  for (size_t i = 0; i < tracks.size(); ++i) {
+    if (tracks[i].options.sync_reference >= 0
+        || (i == 1 && top_follows_bottom)) {
+      continue;
+    }
+    Log(Log_Level::info) << "Syncing the " << tracks[i].options.label
+                         << " to the audio...\n";
+    Audio_Sync_Result result = audio_sync(voice, tracks[i].srt);
+    log_printf(
+      Log_Level::info,
+      "Best shift found: %.2f seconds\nConfidence: %.2f\n",
+      result.shift,
+      result.confidence
+    );
+    const Time_Map map{1.0, result.shift};
+    std::vector<size_t> shifted = {i};
+    if (i == 0 && top_follows_bottom) {
+      shifted.push_back(1);
+    }
+    for (size_t j : shifted) {
+      tracks[j].sync = Time_Transform(map).after(tracks[j].sync);
+    }
+    Sync_Report report;
+    report.track = tracks[i].options.label;
+    report.reference = "audio";
+    report.method = "audio";
+    report.map = map;
+    report.confidence = result.confidence;
+    reports.push_back(std::move(report));
+  }
+  return true;
+}
 
-double alignment_distance(const SRT_File &a, const SRT_File &b, double offset_b)
+// Maps the cues of the track through the sync found for it, in one pass
+// however many syncs it went through.
+void apply_sync(Input_Track &track)
 {
-  double distance = 0.0;
-  for (size_t idx_a = 0; idx_a < a.subtitles.size(); ++idx_a) {
-    Time start = a.subtitles[idx_a].start - offset_b;
-    Time stop = a.subtitles[idx_a].stop - offset_b;
-
-    const double search_window = 8.0; // seconds.
-
-    const auto it_start = std::lower_bound(
-      b.subtitles.begin(),
-      b.subtitles.end(),
-      start - search_window * 0.5,
-      SRT_Subtitle_Time_Comparator()
-    );
+  if (track.sync.is_identity()) {
+    return;
+  }
+  time_transform(track.srt, track.sync);
+  track.map = track.sync.after(track.map);
+  track.sync = {};
+}
 
-    auto it = it_start;
-    auto it_closest = it;
-    while (it != b.subtitles.end()) {
-      if (std::abs(it->start - start) < std::abs(it_closest->start - start)) {
-        it_closest = it;
+// Writes the sync reports as JSON, or as CSV with a row per point of the cost
+// curves.
+void write_sync_report(
+  std::ostream &out,
+  const std::vector<Sync_Report> &reports,
+  bool json
+)
+{
+  if (!json) {
+    out << "track,reference,method,best_shift,scale,confidence,basin_width,"
+           "shift,cost,pruned\n";
+    for (const Sync_Report &report : reports) {
+      char prefix[256];
+      std::snprintf(
+        prefix,
+        sizeof(prefix),
+        "\"%s\",\"%s\",%s,%.3f,%.6f,%.3f,%.2f,",
+        report.track.c_str(),
+        report.reference.c_str(),
+        report.method,
+        report.map.shift,
+        report.map.scale,
+        report.confidence,
+        report.basin_width
+      );
+      if (report.curve.empty()) {
+        out << prefix << ",,\n";
       }
-      if (it->start > start + search_window * 0.5) {
-        break;
+      for (const Sync_Report::Point &point : report.curve) {
+        char row[64];
+        std::snprintf(
+          row,
+          sizeof(row),
+          "%.2f,%.3f,%d\n",
+          point.shift,
+          point.cost,
+          point.pruned
+        );
+        out << prefix << row;
       }
-      it++;
     }
+    return;
+  }
+  out << "[";
+  for (size_t i = 0; i < reports.size(); ++i) {
+    const Sync_Report &report = reports[i];
+    char buf[256];
+    std::snprintf(
+      buf,
+      sizeof(buf),
+      "\"method\": \"%s\", \"shift\": %.3f, \"scale\": %.6f, "
+      "\"confidence\": %.3f, \"basin_width\": %.2f,",
+      report.method,
+      report.map.shift,
+      report.map.scale,
+      report.confidence,
+      report.basin_width
+    );
+    out << (i ? ",\n" : "\n") << "  {\"track\": \"" << report.track
+        << "\", \"reference\": \"" << report.reference << "\", " << buf
+        << "\n   \"curve\": [";
+    for (size_t k = 0; k < report.curve.size(); ++k) {
+      const Sync_Report::Point &point = report.curve[k];
+      std::snprintf(
+        buf,
+        sizeof(buf),
+        "%s{\"shift\": %.2f, \"cost\": %.3f, \"pruned\": %s}",
+        k ? ", " : "",
+        point.shift,
+        point.cost,
+        point.pruned ? "true" : "false"
+      );
+      out << buf;
+    }
+    out << "]}";
+  }
+  out << "\n]\n";
+}
+// }}}
+
+// Writes the --profile, --metrics-json and --trace reports, if requested.
+void write_reports(argparse::ArgumentParser &program)
+{
+  if (program.get<bool>("--profile")) {
+    print_metrics(std::cout, g_metrics);
+  }
+  if (program.is_used("--metrics-json")) {
+    std::ofstream out(program.get("--metrics-json"));
+    write_metrics_json(out, g_metrics);
+  }
+  if (program.is_used("--trace")) {
+    std::ofstream out(program.get("--trace"));
+    write_trace_json(out);
+  }
+}
 
-    if (it_closest != b.subtitles.end()) {
-      const SRT_Subtitle &sub_b = *it_closest;
-      distance += std::abs(sub_b.start - start);
-      distance += std::abs(sub_b.stop - stop);
+// Appends the cue pairs of a --sync-anchors file, one BOTTOM TOP pair per
+// line as for --sync-tb, to `pairs`. Blank lines and lines starting with
+// # are skipped.
+bool read_sync_anchors(const std::string &filename, std::vector<int> &pairs)
+{
+  std::string content;
+  if (!read_file(filename, content)) {
+    Log(Log_Level::error) << "Cannot open " << filename << ".\n";
+    return false;
+  }
+  std::istringstream in(content);
+  std::string line;
+  for (int number = 1; std::getline(in, line); ++number) {
+    std::string_view view = trim(line);
+    if (view.empty() || view[0] == '#') {
+      continue;
     }
+    std::istringstream fields{std::string(view)};
+    int bottom, top;
+    std::string rest;
+    if (!(fields >> bottom >> top) || fields >> rest) {
+      Log(Log_Level::error) << filename << ":" << number
+                            << ": expected a bottom and a top cue number.\n";
+      return false;
+    }
+    pairs.push_back(bottom);
+    pairs.push_back(top);
   }
-  return distance;
+  return true;
 }
 
-int main(int argc, char **argv)
+// Adds the command line options to `program`, which is created without
+// argparse's own -v/--version, as -v is --verbose here. `verbosity` counts
+// the -v.
+void add_arguments(argparse::ArgumentParser &program, int &verbosity)
 {
-  argparse::ArgumentParser program(argv[0]);
+  program.add_argument("--version")
+    .help("prints version information and exits")
+    .action([&](const auto &) {
+      std::cout << "1.0" << std::endl;
+      std::exit(0);
+    })
+    .default_value(false)
+    .implicit_value(true)
+    .nargs(0);
 
   program.add_argument("-b", "--bottom")
-    .help("SRT file for the bottom subtitles file.")
+    .help(
+      "SRT file for the bottom subtitles file (- for stdin). WebVTT, ASS/SSA "
+      "and MicroDVD files are read too."
+    )
     //.required()
     ;
   program.add_argument("--b-enc", "--bottom-enc")
@@ -337,7 +4589,7 @@ int main(int argc, char **argv)
     .scan<'f', double>();
 
   program.add_argument("-t", "--top")
-    .help("SRT file for the top subtitles file.")
+    .help("SRT file for the top subtitles file (- for stdin).")
     //.required()
     ;
   program.add_argument("--t-enc", "--top-enc")
@@ -349,144 +4601,791 @@ int main(int argc, char **argv)
     .scan<'f', double>();
   program.add_argument("--sync-top-to-bottom", "--sync-tb")
     .help(
-      "Time synchronize the [arg-0]th subtitle entry of the top SRT file to "
-      "the [arg-1]th subtitle entry of the bottom SRT file."
+      "Time synchronize the cue numbered [arg-1] in the top SRT file to the "
+      "one numbered [arg-0] in the bottom SRT file. Repeatable: with several "
+      "pairs, the top file is mapped piecewise-linearly through all of them, "
+      "which corrects drift."
     )
     .nargs(2)
+    .append()
+    .scan<'i', int>();
+  program.add_argument("--sync-anchors")
+    .help(
+      "File of --sync-tb pairs, a BOTTOM TOP pair of cue numbers per line. "
+      "Lines starting with # are skipped."
+    );
+  program.add_argument("--sync-by-index")
+    .help(
+      "Take the cues of --sync-tb and --sync-anchors by their position in "
+      "the file, counting from 0, rather than by their number."
+    )
+    .flag();
+  program.add_argument("--show-cue")
+    .help(
+      "Print the cue numbered N of every input, to pick --sync-tb pairs, "
+      "and exit."
+    )
     .scan<'i', int>();
   program.add_argument("--auto-sync-top-to-bottom", "--auto-sync-tb")
     .help(
       "Automatically time synchronize the top SRT file to the bottom SRT file."
     )
     .flag();
+  program.add_argument("--sync-method")
+    .help(
+      "How auto-sync matches tracks: \"timing\" searches the shift within "
+      "+-10 s that best aligns the cue times; \"anchors\" matches cues "
+      "through shared numbers, names and punctuation, for offsets of any "
+      "size and frame rate drift. Also method= per --track."
+    )
+    .default_value(std::string("timing"));
+  program.add_argument("--sync-cost")
+    .help(
+      "How timing auto-sync scores a shift from the errors of the cues: "
+      "\"l1\" sums them, \"truncated\" caps each at 2 s, \"huber\" "
+      "squares the small ones, and \"trimmed\" leaves out the worst 10%, so "
+      "that cues without a counterpart don't throw it off."
+    )
+    .default_value(std::string("l1"));
+  program.add_argument("--sync-sample")
+    .help(
+      "Score the shifts of timing auto-sync on this fraction of the cues "
+      "(e.g. 0.02), spread evenly over time, and only the best 5 on all of "
+      "them. For tracks of 100k+ cues."
+    )
+    .default_value(0.0)
+    .scan<'f', double>();
+  program.add_argument("--sync-time-budget-ms")
+    .help(
+      "Stop timing auto-sync after this many milliseconds with the best "
+      "shift found so far; the search goes from coarse to fine steps, so it "
+      "is usable early. Checked between shifts. 0 for no limit."
+    )
+    .default_value(0.0)
+    .scan<'f', double>();
+  program.add_argument("--sync-audio")
+    .help(
+      "Sync the tracks that aren't synced to another one to the speech in a "
+      "16-bit PCM WAV file, such as from ffmpeg -i VIDEO -vn -ac 1 -ar 16000 "
+      "audio.wav, for shifts of up to 60 s. With --sync-tb, the top track "
+      "follows the bottom one."
+    );
+  program.add_argument("--sync-report")
+    .help(
+      "Write what auto-sync found to FILE: per track the shift, a confidence "
+      "from 0 (ambiguous) to 1 (clear) and the cost of every shift tried. "
+      "JSON if FILE ends in .json, CSV otherwise."
+    );
+  program.add_argument("--min-sync-confidence")
+    .help(
+      "Fail instead of writing the output if the confidence of any auto-sync "
+      "is below this (0 to 1), so that ambiguous syncs get checked."
+    )
+    .default_value(0.0)
+    .scan<'f', double>();
+  program.add_argument("--track")
+    .help(
+      "Additional SRT file, as FILE[,enc=E][,shift=S][,style=NAME][,align=N]"
+      "[,margin=N][,color=&HAABBGGRR][,sync=N]. Repeatable. Tracks are "
+      "numbered in order from 0, after --bottom and --top; sync=N auto-syncs "
+      "this track to track N. Also format=srt|vtt|ass|microdvd, to override "
+      "the format detected from the contents, and fps=F."
+    )
+    .append();
+  program.add_argument("--fps")
+    .help(
+      "Frame rate of MicroDVD inputs, if they don't give it in their first "
+      "line (23.976 otherwise)."
+    )
+    .scan<'f', double>();
 
   program.add_argument("--output", "-o")
-    .help("The output ASS filename.")
-    .required();
+    .help(
+      "The output filename (- for stdout). Repeatable, to write several "
+      "formats at once. The format follows from the extension (.ass, .vtt, "
+      ".srt, .ttml) or a FORMAT: prefix, as in vtt:-, and defaults to ASS."
+    )
+    .append();
   program.add_argument("--o-enc")
     .help("Output encoding")
     .default_value("UTF-8");
+  program.add_argument("--pair-cues")
+    .help(
+      "Join each top cue with the bottom cue it overlaps most into a single "
+      "event, the top text above the bottom one, so that the two don't "
+      "flicker in and out separately. Needs exactly two tracks."
+    )
+    .flag();
+  program.add_argument("--resolve-collisions")
+    .help(
+      "Place overlapping events of a style on their own layers, stacked by "
+      "MarginV, instead of leaving the layout to the player."
+    )
+    .flag();
 
-  try {
-    program.parse_args(argc, argv);
-  } catch (std::exception &err) {
-    std::cout << "Error: " << err.what() << "\n";
-    std::cout << program;
+  program.add_argument("--stream")
+    .help(
+      "Merge while reading, with constant memory, emitting events as soon as "
+      "they are final. Requires both inputs to be sorted by start time; only "
+      "fixed time shifts are supported."
+    )
+    .flag();
+  program.add_argument("--stream-window")
+    .help("Number of cues per track held back to absorb local disorder.")
+    .default_value(8)
+    .scan<'i', int>();
+  program.add_argument("--follow")
+    .help(
+      "Like --stream, but keep following the inputs as they grow (live "
+      "captioning), appending events as cues are completed. Stop with "
+      "Ctrl-C."
+    )
+    .flag();
+  program.add_argument("--follow-max-latency-ms")
+    .help(
+      "Longest time a completed cue is held back waiting for the other track "
+      "in --follow mode."
+    )
+    .default_value(500)
+    .scan<'i', int>();
+  program.add_argument("--watch")
+    .help(
+      "Keep running and re-merge whenever one of the SRT files is saved. Only "
+      "the edited cues are re-parsed; the other track and the sync are reused."
+    )
+    .flag();
+
+  program.add_argument("--threads")
+    .help("Number of worker threads for parsing large files (0: one per core).")
+    .default_value(0)
+    .scan<'i', int>();
+
+  program.add_argument("-q", "--quiet").help("Only print errors.").flag();
+  program.add_argument("-v", "--verbose")
+    .help(
+      "Print more details (-vv: also every shift tried by auto-sync). "
+      "Messages go to stderr."
+    )
+    .action([&](const auto &) { ++verbosity; })
+    .append()
+    .default_value(false)
+    .implicit_value(true)
+    .nargs(0);
+
+  program.add_argument("--profile")
+    .help("Print per-stage timings and resource counters when done.")
+    .flag();
+  program.add_argument("--metrics-json")
+    .help("Write per-stage timings and resource counters as JSON to FILE.");
+  program.add_argument("--trace")
+    .help(
+      "Write a trace-event JSON timeline to FILE (for chrome://tracing or "
+      "Perfetto)."
+    );
+
+  program.add_argument("--batch")
+    .help(
+      "Run the jobs in FILE one after the other: a command line per line, "
+      "without the program name (# for comments). -q, -v and the reports "
+      "given next to --batch cover the whole batch."
+    );
+  program.add_argument("--sync-group")
+    .help(
+      "In a --batch job: jobs with the same KEY, such as a series and "
+      "release, share auto-sync shifts. Later jobs search around the shifts "
+      "of the earlier ones, and over all shifts only if that is ambiguous."
+    );
+}
+
+// Runs the job on the command line in `program`. `priors` are the shifts
+// that auto-sync found for the earlier jobs of its --batch group, if any.
+int run_job(
+  argparse::ArgumentParser &program,
+  std::vector<std::vector<double>> *priors
+)
+{
+  if (program.is_used("--threads")) {
+    g_threads = std::max(0, program.get<int>("--threads"));
+  }
+  g_count_allocations |=
+    program.get<bool>("--profile") || program.is_used("--metrics-json");
+  const bool watch = program.get<bool>("--watch");
+  const bool follow = program.get<bool>("--follow");
+  const bool stream = program.get<bool>("--stream") || follow;
+  const bool pair_cues = program.get<bool>("--pair-cues");
+  const bool place_events = program.get<bool>("--resolve-collisions");
+
+  const std::optional<int> show_cue = program.present<int>("--show-cue");
+  if (!program.is_used("--output") && !show_cue) {
+    Log(Log_Level::error) << "Error: --output is required.\n" << program;
     return 1;
   }
+  std::vector<Output> outputs;
+  bool to_stdout = false;
+  for (std::string filename : program.is_used("--output")
+         ? program.get<std::vector<std::string>>("--output")
+         : std::vector<std::string>()) {
+    const Output_Format &format = output_format(filename);
+    to_stdout |= filename == "-";
+    outputs.push_back({&format, filename});
+  }
+  if (to_stdout) {
+    // Keep the --profile report out of the subtitles written to stdout.
+    std::cout.rdbuf(std::cerr.rdbuf());
+  }
 
-  SRT_File bottom_srt;
+  const std::string o_enc = program.get("--o-enc");
+  std::vector<Track_Options> specs;
   if (program.is_used("--bottom")) {
-    std::cout << "Reading bottom SRT file...\n";
-    std::string srt_filename = program.get("--bottom");
-    std::ifstream in(srt_filename);
-    bottom_srt = parse_srt_file(in);
-    if (program.get("--b-enc") != program.get("--o-enc")) {
-      std::cout << "Converting bottom SRT encoding...\n";
-      convert_encoding(
-        bottom_srt,
-        program.get("--b-enc").c_str(),
-        program.get("--o-enc").c_str()
-      );
+    specs.push_back(
+      {"bottom",
+       program.get("--bottom"),
+       program.get("--b-enc"),
+       program.present<double>("--b-shift").value_or(0.0),
+       -1,
+       g_builtin_styles[0]}
+    );
+  }
+  if (program.is_used("--top")) {
+    specs.push_back(
+      {"top",
+       program.get("--top"),
+       program.get("--t-enc"),
+       program.present<double>("--t-shift").value_or(0.0),
+       -1,
+       g_builtin_styles[1]}
+    );
+  }
+  const bool top_and_bottom =
+    program.is_used("--bottom") && program.is_used("--top");
+  std::vector<int> sync_pairs;  // (bottom, top) cue indices.
+  if (program.is_used("--sync-tb")) {
+    sync_pairs = program.get<std::vector<int>>("--sync-tb");
+  }
+  if (program.is_used("--sync-anchors")
+      && !read_sync_anchors(program.get("--sync-anchors"), sync_pairs)) {
+    return 1;
+  }
+  if ((!sync_pairs.empty() || program.get<bool>("--auto-sync-tb"))
+      && !top_and_bottom) {
+    Log(Log_Level::error)
+      << "Syncing top to bottom requires both --bottom and --top.\n";
+    return 1;
+  }
+  const std::string sync_method = program.get("--sync-method");
+  if (sync_method != "timing" && sync_method != "anchors") {
+    Log(Log_Level::error) << "Unknown sync method \"" << sync_method << "\".\n";
+    return 1;
+  }
+  Timing_Sync_Options timing_sync;
+  timing_sync.sample = program.get<double>("--sync-sample");
+  timing_sync.time_budget_ms = program.get<double>("--sync-time-budget-ms");
+  {
+    const std::string name = program.get("--sync-cost");
+    auto it = std::find(
+      std::begin(g_sync_cost_names), std::end(g_sync_cost_names), name
+    );
+    if (it == std::end(g_sync_cost_names)) {
+      Log(Log_Level::error) << "Unknown sync cost \"" << name << "\".\n";
+      return 1;
+    }
+    timing_sync.cost = Sync_Cost(it - std::begin(g_sync_cost_names));
+  }
+  const Sync_Method default_sync_method =
+    sync_method == "anchors" ? Sync_Method::anchors : Sync_Method::timing;
+  for (Track_Options &spec : specs) {
+    spec.sync_method = default_sync_method;
+  }
+  if (program.get<bool>("--auto-sync-tb")) {
+    specs[1].sync_reference = 0;
+  }
+  if (program.is_used("--track")) {
+    for (const std::string &spec :
+         program.get<std::vector<std::string>>("--track")) {
+      Track_Options track;
+      track.label = "track " + std::to_string(specs.size());
+      track.sync_method = default_sync_method;
+      if (!parse_track_spec(spec, specs.size(), track)) {
+        return 1;
+      }
+      specs.push_back(track);
+    }
+  }
+  if (!validate_tracks(specs)) {
+    return 1;
+  }
+  std::vector<ASS_Style> styles;
+  size_t from_stdin = 0;
+  bool synced = !sync_pairs.empty() || program.is_used("--sync-audio");
+  for (Track_Options &track : specs) {
+    if (track.fps == 0.0) {
+      track.fps = program.present<double>("--fps").value_or(0.0);
     }
+    styles.push_back(track.style);
+    from_stdin += track.filename == "-";
+    synced |= track.sync_reference >= 0;
+  }
+  if (from_stdin > 1) {
+    Log(Log_Level::error) << "Only one of the inputs can be read from stdin.\n";
+    return 1;
+  }
+  if (watch && (stream || to_stdout || from_stdin)) {
+    Log(Log_Level::error) << "--watch works on files only.\n";
+    return 1;
+  }
+  if (pair_cues && (specs.size() != 2 || stream)) {
+    Log(Log_Level::error) << "--pair-cues pairs exactly two tracks, and not "
+                             "with --stream or --follow.\n";
+    return 1;
+  }
 
-    if (bottom_srt.subtitles.empty()) {
-      std::cout << "Bottom subtitle file does not contain any subtitles.\n";
+  if (stream) {
+    if (synced) {
+      Log(Log_Level::error)
+        << "--stream and --follow only support fixed time shifts.\n";
       return 1;
     }
-  }
+    if (outputs.size() != 1) {
+      Log(Log_Level::error) << "--stream and --follow write a single output.\n";
+      return 1;
+    }
+    const Output_Format &format = *outputs[0].format;
+    std::unique_ptr<std::ostream> out = open_output(outputs[0].filename);
+    std::vector<Stream_Track> tracks;
+    for (const Track_Options &spec : specs) {
+      int fd = spec.filename == "-" ? 0 : open(spec.filename.c_str(), O_RDONLY);
+      if (fd < 0) {
+        Log(Log_Level::error) << "Cannot open " << spec.filename << ".\n";
+        return 1;
+      }
+      tracks.emplace_back(fd, out.get(), spec.shift);
+      if (spec.encoding != o_enc) {
+        tracks.back().cvt =
+          open_converter(spec.encoding.c_str(), o_enc.c_str());
+      }
+      SRT_Stream_Reader &reader = tracks.back().reader;
+      reader.fill();
+      const Input_Format &input_format =
+        spec.format ? *spec.format : sniff_input_format(reader.buf);
+      if (&input_format != g_srt_format) {
+        Log(Log_Level::error)
+          << "--stream and --follow read SRT only, but " << spec.filename
+          << " is " << input_format.description << ".\n";
+        return 1;
+      }
+    }
+    const size_t window = std::max(1, program.get<int>("--stream-window"));
+    std::unique_ptr<Collision_Resolver> resolver;
+    if (place_events) {
+      resolver = std::make_unique<Collision_Resolver>(styles);
+    }
+    if (follow) {
+      struct sigaction action = {};
+      action.sa_handler = [](int) { g_stop_requested = 1; };
+      sigaction(SIGINT, &action, nullptr);
+      sigaction(SIGTERM, &action, nullptr);
 
-  SRT_File top_srt;
-  if (program.is_used("--top")) {
-    std::cout << "Reading top SRT file...\n";
-    std::string srt_filename = program.get("--top");
-    std::ifstream in(srt_filename);
-    top_srt = parse_srt_file(in);
-    if (program.get("--t-enc") != program.get("--o-enc")) {
-      std::cout << "Converting top SRT encoding...\n";
-      convert_encoding(
-        top_srt, program.get("--t-enc").c_str(), program.get("--o-enc").c_str()
+      std::chrono::milliseconds max_latency(
+        program.get<int>("--follow-max-latency-ms")
+      );
+      Latency_Histogram latency;
+      {
+        Scoped_Timer timer("follow merge");
+        follow_merge(
+          tracks,
+          styles,
+          resolver.get(),
+          format,
+          *out,
+          window,
+          max_latency,
+          latency
+        );
+      }
+      log_printf(
+        Log_Level::info,
+        "Latency over %zu events: mean %.1f ms, p50 %.0f ms, p99 %.0f ms, "
+        "max %.1f ms\n",
+        latency.count,
+        latency.count ? latency.sum_ms / latency.count : 0.0,
+        latency.percentile(0.50),
+        latency.percentile(0.99),
+        latency.max_ms
       );
+      write_reports(program);
+      return 0;
     }
+    size_t out_of_order;
+    {
+      Scoped_Timer timer("stream merge");
+      out_of_order =
+        stream_merge(tracks, styles, resolver.get(), format, *out, window);
+    }
+    if (out_of_order) {
+      Log(Log_Level::error)
+        << "Warning: " << out_of_order
+        << " events were written out of order; the inputs are not sorted "
+           "well enough for --stream-window.\n";
+    }
+    write_reports(program);
+    return 0;
+  }
 
-    if (top_srt.subtitles.empty()) {
-      std::cout << "Top subtitle file does not contain any subtitles.\n";
+  // All tracks are loaded at the same time, as reading them is mostly waiting
+  // on slow storage. Their messages are printed in order afterwards.
+  std::vector<Input_Track> tracks(specs.size());
+  std::vector<std::string> logs(specs.size());
+  std::vector<char> loaded(specs.size(), false);
+  const bool sync_by_number =
+    !sync_pairs.empty() && !program.get<bool>("--sync-by-index");
+  {
+    std::vector<std::thread> loaders;
+    for (size_t i = 0; i < specs.size(); ++i) {
+      tracks[i].options = specs[i];
+      loaders.push_back(traced_thread([&, i] {
+        t_log_buffer = &logs[i];
+        Input_Track &track = tracks[i];
+        loaded[i] = load_track(track, o_enc, watch);
+        if (loaded[i] && (show_cue || (sync_by_number && i < 2))) {
+          track.numbers = build_cue_number_index(track.srt);
+          if (track.numbers.repeats > 0) {
+            Log(Log_Level::info)
+              << "The " << track.options.label << " subtitle file repeats "
+              << track.numbers.repeats << " cue numbers; the first cue of "
+              << "each is used.\n";
+          }
+        }
+      }));
+    }
+    for (std::thread &loader : loaders) {
+      loader.join();
+    }
+  }
+  for (size_t i = 0; i < specs.size(); ++i) {
+    log_write(logs[i]);
+    if (!loaded[i]) {
       return 1;
     }
   }
 
-  std::cout << "Top subtitle file contains " << bottom_srt.subtitles.size()
-            << " subtitles.\n";
-  std::cout << "Top subtitle file contains " << top_srt.subtitles.size()
-            << " subtitles.\n";
+  if (show_cue) {
+    bool found = false;
+    for (const Input_Track &track : tracks) {
+      long i = track.numbers.find(*show_cue);
+      std::cout << track.options.label << " #" << *show_cue;
+      if (i < 0) {
+        std::cout << ": none\n";
+        continue;
+      }
+      // As in the file, before any shift.
+      const SRT_Subtitle &sub = track.srt.subtitles[i];
+      std::string times;
+      append_clock_time(times, sub.start - track.options.shift, ',');
+      times += " --> ";
+      append_clock_time(times, sub.stop - track.options.shift, ',');
+      std::cout << " (at position " << i << "): " << times << "\n"
+                << sub.text << "\n";
+      found = true;
+    }
+    return found ? 0 : 1;
+  }
 
-  if (program.is_used("--sync-tb")) {
-    auto pair = program.get<std::vector<int>>("--sync-tb");
-    if (pair[0] >= (int)bottom_srt.subtitles.size() || pair[0] < 0) {
-      std::cout << "Subtitle index " << pair[0]
-                << " is out of bounds for the bottom subtitle file, which has "
-                << bottom_srt.subtitles.size() << " subtitles.\n";
+  if (!sync_pairs.empty()) {
+    SRT_File &bottom_srt = tracks[0].srt;
+    SRT_File &top_srt = tracks[1].srt;
+    // Both were shifted while parsing; the sync is between the file times,
+    // as (top time, bottom time + top shift - bottom shift).
+    std::vector<std::pair<Time, Time>> anchors;
+    for (size_t k = 0; k < sync_pairs.size(); k += 2) {
+      long b = sync_pairs[k];
+      long t = sync_pairs[k + 1];
+      if (sync_by_number) {
+        b = tracks[0].numbers.find(sync_pairs[k]);
+        t = tracks[1].numbers.find(sync_pairs[k + 1]);
+        for (int j : {0, 1}) {
+          if ((j == 0 ? b : t) < 0) {
+            Log(Log_Level::error)
+              << "The " << tracks[j].options.label
+              << " subtitle file has no cue numbered " << sync_pairs[k + j]
+              << " (see --show-cue, or --sync-by-index for positions).\n";
+            return 1;
+          }
+        }
+      }
+      if (b >= (long)bottom_srt.subtitles.size() || b < 0) {
+        Log(Log_Level::error)
+          << "Subtitle index " << b
+          << " is out of bounds for the bottom subtitle file, which has "
+          << bottom_srt.subtitles.size() << " subtitles.\n";
+        return 1;
+      }
+      if (t >= (long)top_srt.subtitles.size() || t < 0) {
+        Log(Log_Level::error)
+          << "Subtitle index " << t
+          << " is out of bounds for the top subtitle file, which has "
+          << top_srt.subtitles.size() << " subtitles.\n";
+        return 1;
+      }
+      SRT_Subtitle &bot = bottom_srt.subtitles[b];
+      SRT_Subtitle &top = top_srt.subtitles[t];
+      if (sync_by_number) {
+        Log(Log_Level::info) << "Syncing top to bottom: top #" << top.num
+                             << " -> bottom #" << bot.num << "\n";
+      } else {
+        Log(Log_Level::info) << "Syncing top to bottom: top[" << t
+                             << "] -> bottom[" << b << "]\n";
+      }
+      Log(Log_Level::info) << "  Top   : " << top.text << "\n";
+      Log(Log_Level::info) << "  Bottom: " << bot.text << "\n";
+      double shift = (bot.start - tracks[0].options.shift)
+        - (top.start - tracks[1].options.shift);
+      Log(Log_Level::info) << "Shift: " << shift << "s\n";
+      anchors.push_back({top.start, top.start + shift});
+    }
+    std::sort(anchors.begin(), anchors.end());
+    Time_Transform map;
+    if (!piecewise_linear(anchors, map)) {
+      Log(Log_Level::error) << "The sync anchors must be in the same order in "
+                               "both subtitle files, without repeats.\n";
       return 1;
     }
-    if (pair[1] >= (int)bottom_srt.subtitles.size() || pair[1] < 0) {
-      std::cout << "Subtitle index " << pair[1]
-                << " is out of bounds for the top subtitle file, which has "
-                << top_srt.subtitles.size() << " subtitles.\n";
+    if (anchors.size() > 1) {
+      Log(Log_Level::info) << "Mapping the top subtitles through "
+                           << anchors.size() << " anchors...\n";
+    }
+    tracks[1].sync = map;
+  }
+
+  if (synced) {
+    std::vector<Sync_Report> reports;
+    if (program.is_used("--sync-audio")
+        && !sync_to_audio(
+          program.get("--sync-audio"), tracks, !sync_pairs.empty(), reports
+        )) {
       return 1;
     }
-    SRT_Subtitle &bot = bottom_srt.subtitles[pair[0]];
-    SRT_Subtitle &top = top_srt.subtitles[pair[1]];
-    std::cout << "Syncing top to bottom: top[" << pair[1] << "] -> bottom["
-              << pair[0] << "]\n";
-    std::cout << "  Top   : " << top.text << "\n";
-    std::cout << "  Bottom: " << bot.text << "\n";
-    double shift = bot.start - top.start;
-    std::cout << "Shift: " << shift << "s\n";
-    time_shift(top_srt, shift);
+    std::vector<Sync_Report> track_reports = sync_tracks(
+      tracks,
+      timing_sync,
+      program.is_used("--sync-report")
+        || program.is_used("--min-sync-confidence"),
+      priors
+    );
+    std::move(
+      track_reports.begin(), track_reports.end(), std::back_inserter(reports)
+    );
+    if (program.is_used("--sync-report")) {
+      std::string filename = program.get("--sync-report");
+      std::ofstream out(filename);
+      write_sync_report(
+        out,
+        reports,
+        std::filesystem::path(filename).extension() == ".json"
+      );
+    }
+    const double min_confidence = program.get<double>("--min-sync-confidence");
+    for (const Sync_Report &report : reports) {
+      if (report.confidence < min_confidence) {
+        log_printf(
+          Log_Level::error,
+          "The sync of the %s is ambiguous (confidence %.2f < %.2f); not "
+          "writing the output. Check it, or sync it by hand with --sync-tb or "
+          "shift=.\n",
+          report.track.c_str(),
+          report.confidence,
+          min_confidence
+        );
+        return 1;
+      }
+    }
+  }
+
+  if (synced) {
+    Scoped_Timer timer("apply sync");
+    for (Input_Track &track : tracks) {
+      apply_sync(track);
+    }
   }
 
-  if (program.is_used("--t-shift")) {
-    std::cout << "Time shifting top subtitles by: "
-              << program.get<double>("--t-shift") << " seconds...\n";
-    time_shift(top_srt, program.get<double>("--t-shift"));
+  std::vector<const SRT_File *> merged;
+  for (const Input_Track &track : tracks) {
+    merged.push_back(&track.srt);
   }
-  if (program.is_used("--b-shift")) {
-    std::cout << "Time shifting bottom subtitles by: "
-              << program.get<double>("--b-shift") << " seconds...\n";
-    time_shift(bottom_srt, program.get<double>("--b-shift"));
+  merge_and_write(merged, styles, pair_cues, place_events, outputs);
+
+  write_reports(program);
+
+  if (watch) {
+    std::vector<Watched_Track> watched;
+    for (Input_Track &track : tracks) {
+      watched.push_back(
+        {track.options.filename,
+         track.options.format,
+         track.options.fps,
+         track.options.encoding,
+         std::move(track.content),
+         std::move(track.offsets),
+         &track.srt,
+         track.map,
+         -1}
+      );
+    }
+    return watch_and_remerge(
+      watched, merged, styles, pair_cues, place_events, o_enc, outputs
+    );
   }
+  return 0;
+}
 
-  if (program.is_used("--auto-sync-tb")) {
-    std::cout << "Auto syncing...\n";
-    double best_distance = std::numeric_limits<double>::max();
-    double best_shift = 0;
-    for (double shift = -10.0; shift <= 10.001; shift += 0.05) {
-      double distance_A = alignment_distance(bottom_srt, top_srt, shift);
-      double distance_B = alignment_distance(top_srt, bottom_srt, -shift);
-      std::printf("  Attempting shift %+6.2f seconds... Distance: %8.1f | %8.1f\n", shift, distance_A, distance_B);
-      if (distance_A + distance_B < best_distance) {
-        best_distance = distance_A + distance_B;
-        best_shift = shift;
+// Splits a --batch line into arguments at blank space, except within single
+// or double quotes.
+std::vector<std::string> split_command_line(std::string_view line)
+{
+  std::vector<std::string> args;
+  bool in_arg = false;
+  char quote = 0;
+  for (char c : line) {
+    if (quote) {
+      if (c == quote) {
+        quote = 0;
+      } else {
+        args.back() += c;
+      }
+    } else if (c == '"' || c == '\'') {
+      if (!in_arg) {
+        args.emplace_back();
+      }
+      in_arg = true;
+      quote = c;
+    } else if (c == ' ' || c == '\t' || c == '\r') {
+      in_arg = false;
+    } else {
+      if (!in_arg) {
+        args.emplace_back();
       }
+      in_arg = true;
+      args.back() += c;
     }
-    std::printf("Best shift found: %.2f seconds\n", best_shift);
+  }
+  return args;
+}
 
-    time_shift(top_srt, best_shift);
+// Runs the --batch jobs in `filename` in order, and returns the number of
+// them that failed, listing them in the end. A job that fails, even by
+// throwing on malformed input, only fails itself. Every job starts from the
+// settings of the batch, and its --profile and --metrics-json cover it
+// alone; those of the batch cover all jobs.
+size_t run_batch(const std::string &filename, const char *program_name)
+{
+  std::string content;
+  if (!read_file(filename, content)) {
+    Log(Log_Level::error) << "Cannot open " << filename << ".\n";
+    return 1;
+  }
+  // The shifts found per track, by --sync-group.
+  std::unordered_map<std::string, std::vector<std::vector<double>>> groups;
+  std::istringstream in(content);
+  std::string line;
+  size_t jobs = 0;
+  std::vector<int> failed;  // line numbers.
+  std::streambuf *const cout_buf = std::cout.rdbuf();
+  const unsigned threads = g_threads;
+  const bool count_allocations = g_count_allocations;
+  Metrics total;
+  total.add(g_metrics);
+  g_metrics.clear();
+  for (int number = 1; std::getline(in, line); ++number) {
+    std::string_view view = trim(line);
+    if (view.empty() || view[0] == '#') {
+      continue;
+    }
+    jobs++;
+    t_trace_job = (int)jobs;
+    Log(Log_Level::info) << "Job " << jobs << " (" << filename << ":"
+                         << number << "):\n";
+    std::vector<std::string> args = split_command_line(view);
+    args.insert(args.begin(), program_name);
+    argparse::ArgumentParser job(
+      program_name, "1.0", argparse::default_arguments::help
+    );
+    int verbosity = 0;  // the batch's own -q and -v apply.
+    add_arguments(job, verbosity);
+    int status = 1;
+    try {
+      job.parse_args(args);
+      if (job.is_used("--batch") || job.get<bool>("--watch")
+          || job.get<bool>("--follow")) {
+        Log(Log_Level::error) << filename << ":" << number
+                              << ": --batch, --watch and --follow can't be "
+                                 "used in a batch job.\n";
+      } else {
+        status = run_job(
+          job,
+          job.is_used("--sync-group") ? &groups[job.get("--sync-group")]
+                                      : nullptr
+        );
+      }
+    } catch (std::exception &err) {
+      Log(Log_Level::error) << filename << ":" << number << ": " << err.what()
+                            << "\n";
+    }
+    if (status != 0) {
+      failed.push_back(number);
+    }
+    std::cout.rdbuf(cout_buf);
+    g_threads = threads;
+    g_count_allocations = count_allocations;
+    total.add(g_metrics);
+    g_metrics.clear();
   }
+  t_trace_job = 0;
+  g_metrics.add(total);
+  if (failed.empty()) {
+    Log(Log_Level::info) << "All " << jobs << " jobs done.\n";
+  } else {
+    Log log(Log_Level::error);
+    log << failed.size() << " of " << jobs << " jobs failed, on lines";
+    for (int number : failed) {
+      log << " " << number;
+    }
+    log << " of " << filename << ".\n";
+  }
+  return failed.size();
+}
 
-  // Merge them
-  ASS_File ass;
-  ass.subtitles.reserve(bottom_srt.subtitles.size() + top_srt.subtitles.size());
-  insert_srt_into_ass(ass, bottom_srt, 0);
-  insert_srt_into_ass(ass, top_srt, 1);
-  std::sort(
-    ass.subtitles.begin(), ass.subtitles.end(), ASS_Subtitle_Comparator()
+#ifndef SRT2ASS_NO_MAIN
+int main(int argc, char **argv)
+{
+  argparse::ArgumentParser program(
+    argv[0], "1.0", argparse::default_arguments::help
   );
-
-  // Write out
-  {
-    std::ofstream out(program.get("--output"));
-    write_ass_file(out, ass);
+  int verbosity = 0;
+  add_arguments(program, verbosity);
+  try {
+    program.parse_args(argc, argv);
+  } catch (std::exception &err) {
+    Log(Log_Level::error) << "Error: " << err.what() << "\n" << program;
+    return 1;
+  }
+  if (program.get<bool>("--quiet")) {
+    g_log_level = Log_Level::error;
+  } else if (verbosity > 0) {
+    g_log_level = verbosity == 1 ? Log_Level::verbose : Log_Level::debug;
+  }
+  g_trace_enabled = program.is_used("--trace");
+  g_threads = std::max(0, program.get<int>("--threads"));
+  if (program.is_used("--batch")) {
+    g_count_allocations =
+      program.get<bool>("--profile") || program.is_used("--metrics-json");
+    size_t failed = run_batch(program.get("--batch"), argv[0]);
+    write_reports(program);
+    return failed ? 1 : 0;
+  }
+  try {
+    return run_job(program, nullptr);
+  } catch (std::exception &err) {
+    Log(Log_Level::error) << "Error: " << err.what() << "\n";
+    return 1;
   }
-  return 0;
 }
+#endif  // SRT2ASS_NO_MAIN